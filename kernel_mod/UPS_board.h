@@ -0,0 +1,109 @@
+/*
+ * Shared-memory status board.
+ *
+ * UPS_comm publishes every parsed sample into a small POSIX shared-memory
+ * segment (/dev/shm/UPS_board by default, see UPS_BOARD_NAME). The data is
+ * guarded by a sequence counter: the writer makes it odd while updating, and
+ * readers retry until they copied the data under one even value. Once mapped,
+ * reading the state takes no system calls.
+ */
+
+#ifndef UPS_BOARD_H
+#define UPS_BOARD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define UPS_BOARD_NAME "/UPS_board"// May be overridden with the UPS_BOARD environment variable.
+#define UPS_BOARD_MAGIC 0x42535055// "UPSB"
+#define UPS_BOARD_VERSION 1
+
+struct ups_board_data {
+	uint64_t updates;// Number of samples published.
+	uint64_t timestamp;// CLOCK_MONOTONIC time of the last sample (nanoseconds).
+	int32_t status;// POWER_SUPPLY_STATUS_* value, see enum ups_status.
+	int32_t percentage;
+	int32_t voltage;// millivolts
+	int32_t external_online;
+	int32_t et_charge;// seconds, -1 if unknown
+	int32_t et_discharge;// seconds, -1 if unknown
+	char version[16];// UPS firmware version.
+};
+
+struct ups_board {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t pad;
+	struct ups_board_data data;
+};
+
+static inline const char *ups_board_name(){
+	const char *name = getenv("UPS_BOARD");
+	return name?name:UPS_BOARD_NAME;
+}
+
+// Create (or reuse) and map the board for writing. Returns NULL on failure.
+static inline struct ups_board *ups_board_create(const char *name){
+	struct ups_board *b;
+	int fd;
+
+	fd = shm_open(name,O_RDWR|O_CREAT,0644);
+	if (fd<0) return NULL;
+	if (ftruncate(fd,sizeof(*b))) {
+		close(fd);
+		return NULL;
+	}
+	b = mmap(NULL,sizeof(*b),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (b==MAP_FAILED) return NULL;
+	if (b->seq&1) b->seq++;// A previous writer died during an update.
+	b->version = UPS_BOARD_VERSION;
+	b->magic = UPS_BOARD_MAGIC;
+	return b;
+}
+
+static inline void ups_board_write(struct ups_board *b,const struct ups_board_data *d){
+	uint32_t seq = b->seq;
+
+	__atomic_store_n(&b->seq,seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&b->data,d,sizeof(*d));
+	__atomic_store_n(&b->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+// Map an existing board for reading. Returns NULL on failure.
+static inline const struct ups_board *ups_board_open(const char *name){
+	const struct ups_board *b;
+	int fd;
+
+	fd = shm_open(name,O_RDONLY,0);
+	if (fd<0) return NULL;
+	b = mmap(NULL,sizeof(*b),PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (b==MAP_FAILED) return NULL;
+	if (b->magic!=UPS_BOARD_MAGIC||b->version!=UPS_BOARD_VERSION) {
+		munmap((void *)b,sizeof(*b));
+		return NULL;
+	}
+	return b;
+}
+
+// Copy a consistent snapshot of the board. Returns -1 if nothing has been published yet.
+static inline int ups_board_read(const struct ups_board *b,struct ups_board_data *d){
+	uint32_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&b->seq,__ATOMIC_ACQUIRE))&1);
+		memcpy(d,(const void *)&b->data,sizeof(*d));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&b->seq,__ATOMIC_RELAXED)!=seq);
+	return d->updates?0:-1;
+}
+
+#endif
@@ -1,23 +1,79 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include "UPS_frame.h"
+#include "UPS_estimate.h"
+#include "UPS_board.h"
+#include "UPS_server.h"
+#include "UPS_queue.h"
+#include "UPS_metrics.h"
+#include "UPS_log.h"
+#include "UPS_filter.h"
+#include "UPS_schema.h"
 
 #define MODPATH "/sys/module/UPS_powermod/parameters/"
+#define STATE_FILE "/var/lib/UPS_comm/state"
+#define STATE_SAVE_INTERVAL 60000000000ULL// Save a steady state at most once a minute (nanoseconds).
+#define LOG_FLUSH_INTERVAL 300// Default telemetry log flush interval (seconds).
 
-const char *BATSTAT[]={"unknown","charging","discharging","not-charging","full"};
+// Module parameter directory. May be overridden with the UPS_MODPATH environment variable, e.g. to run against the simulator without the module.
+const char *modpath = MODPATH;
+// Last good state of every unit, restored at startup. May be overridden with the UPS_STATE_FILE environment variable; UPS_STATE_FILE=off disables it.
+const char *state_file = STATE_FILE;
+// Telemetry log of every published sample (see UPS_log.h), enabled with the UPS_LOG environment variable. UPS_LOG_FLUSH sets the flush interval in seconds; mains loss always flushes.
+const char *log_file = NULL;
+
+
+// Counters and histograms served by the metrics exporter.
+static struct ups_metrics metrics;
+
+/*
+ * Real-time mode, enabled with UPS_RT=N. All memory is locked, and for N from
+ * 1 to 99 the serial reader and the publisher run with SCHED_FIFO priority N;
+ * UPS_RT=0 only locks memory. UPS_RT_CPU=n pins both threads to CPU n. The
+ * metrics exporter keeps the normal scheduling class. Neither thread
+ * allocates after init, and stderr is made non-blocking so that a stalled log
+ * reader loses messages instead of stalling the daemon.
+ */
+#define RT_STACK_SIZE (256*1024)// Stack of the reader thread, locked when it is created.
+#define RT_PREFAULT (64*1024)// Stack of the publisher faulted in before it is locked.
+
+int rt = -1;// -1 when off, else the SCHED_FIFO priority or 0.
+int rt_cpu = -1;
+
+// Log a message once init is done. Formats on the stack and writes it with a single write(); nothing is allocated or buffered.
+static void log_msg(const char *fmt,...){
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap,fmt);
+	len = vsnprintf(buf,sizeof(buf),fmt,ap);
+	va_end(ap);
+	if (len>=(int)sizeof(buf)) len = sizeof(buf)-1;
+	if (write(STDERR_FILENO,buf,len)!=len) ups_metric_add(&metrics.log_drops,1);
+}
 
 int set_interface_attribs(int fd,int speed,int parity){
 	struct termios tty;
 	if (tcgetattr(fd,&tty)!=0){
-		fprintf(stderr,"UPS: Error %d: from tcgetattr.\n",errno);
+		log_msg("UPS: Error %d: from tcgetattr.\n",errno);
 		return -1;
 	}
 
@@ -41,222 +97,845 @@ int set_interface_attribs(int fd,int speed,int parity){
 	tty.c_cflag &= ~CRTSCTS;
 
 	if (tcsetattr(fd,TCSANOW,&tty)!=0){
-		fprintf(stderr,"UPS: Error %d: from tcsetattr.\n",errno);
+		log_msg("UPS: Error %d: from tcsetattr.\n",errno);
 		return -1;
 	}
 	return 0;
 }
 
-void set_blocking(int fd,int should_block){
-	struct termios tty;
-	memset(&tty,0,sizeof tty);
-	if (tcgetattr(fd,&tty)!=0){
-		fprintf(stderr,"UPS: Error %d: from tggetattr.\n",errno);
-		return;
-	}
+unsigned long long monotonic_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
 
-	tty.c_cc[VMIN] = should_block?1:0;
-	tty.c_cc[VTIME] = 5;// 0.5 seconds read timeout
+unsigned long long boottime_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME,&ts);
+	return (unsigned long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+unsigned long long realtime_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return (unsigned long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
 
-	if (tcsetattr(fd,TCSANOW,&tty)!=0)
-		fprintf(stderr, "UPS: Error %d: setting term attributes.\n",errno);
+int open_param(const char *name){
+	char path[256];
+	snprintf(path,sizeof(path),"%s%s",modpath,name);
+	return open(path,O_WRONLY);
 }
 
-// Initialize module parameters
+// Initialize module parameters. This is also the check that the module is loaded and writable.
 int upsmod_init(){
-	// The following parameters (capacity and presence) are not actually supported. Presence is changed to present when ever the serial connection is successful.
-	int out_eng,out_bat;
-	char wbuf[10];
-	out_eng = open(MODPATH "battery_energy",O_WRONLY);
-	out_bat = open(MODPATH "battery_present",O_WRONLY);
-	if (!(out_eng&&out_bat)) return -1;
-	sprintf(wbuf,"%d\0",3700000);
-	write(out_eng,wbuf,strlen(wbuf));
-	sprintf(wbuf,"%d\0",1);
-	write(out_bat,wbuf,strlen(wbuf));
+	// Capacity is not actually supported.
+	int out_eng;
+	char wbuf[16];
+	out_eng = open_param("battery_energy");
+	if (out_eng<0) return -1;
+	sprintf(wbuf,"%d",3700000);
+	if (write(out_eng,wbuf,strlen(wbuf))<0) {
+		close(out_eng);
+		return -1;
+	}
 	close(out_eng);
-	close(out_bat);
 	return 0;
 }
 
-int main(int argc,char *argv[]){
-	// Parse command line arguments for serial device path.
-	if (argc!=2) {
-		fprintf(stderr,"UPS: Invalid arguments!\n");
-		return(-1);
+// Mark the battery of a unit present. Done once its UPS sent a valid frame or its state was restored.
+int upsmod_present(int unit){
+	int out;
+	char wbuf[16];
+	ssize_t n;
+	if (unit==0) {
+		out = open_param("battery_present");
+		strcpy(wbuf,"1");
 	}
+	else {
+		out = open_param("unit_present");
+		sprintf(wbuf,"%d 1",unit);
+	}
+	if (out<0) return -1;
+	n = write(out,wbuf,strlen(wbuf));
+	close(out);
+	return n<0?-1:0;
+}
 
-	int serial = open(argv[1],O_RDWR|O_NOCTTY|O_SYNC);
-	if (serial < 0){
-		fprintf(stderr,"UPS: Error %d opening %s: %s\n",errno,argv[1],strerror(errno));
-		return -1;
+/*
+ * Low-power mode, enabled with UPS_LOWPOWER=N (2 to LOWPOWER_MAX). VMIN is set
+ * to the shortest distance seen between two frame starts, i.e. a frame with
+ * whatever line ending the UPS sends, so that a frame is read in one wakeup. While the
+ * readings are steady and mains power is good only every Nth frame is
+ * processed, and after N steady frames a port is no longer read on arrival
+ * but once every N frame periods, with the frames in between left in the tty
+ * buffer. A change, or Vin NG, switches the port back to reading on arrival.
+ */
+#define LOWPOWER_MAX 60// Keeps a slow read interval of frames well within the tty buffer.
+#define LOWPOWER_VOLT_DELTA 100// mV
+#define LOWPOWER_PERIOD 1000000000ULL// Frame period assumed until one is measured (nanoseconds).
+
+int lowpower;
+
+/*
+ * Filtering of the readings before they are published, see UPS_filter.h. On
+ * by default; UPS_FILTER=off disables it and a comma separated list such as
+ * UPS_FILTER=median=3,ewma=1 changes the settings named. Keys: median
+ * (window), ewma (weight 1/2^n), pct (hysteresis in 1/100 %, at most 50), mv
+ * (hysteresis in mV), vlow (not-charging exit band in mV) and et (estimate
+ * band in %).
+ */
+struct ups_filter_conf filter_conf = UPS_FILTER_DEFAULTS;
+
+// Apply a UPS_FILTER setting. Returns -1 if it is not understood.
+static int parse_filter(const char *spec){
+	static const struct ups_filter_conf off = UPS_FILTER_OFF;
+	char key[16];
+	int n,v;
+
+	if (!strcmp(spec,"off")) {
+		filter_conf = off;
+		return 0;
+	}
+	while (*spec) {
+		if (sscanf(spec,"%15[^=]=%d%n",key,&v,&n)!=2||v<0) return -1;
+		if (!strcmp(key,"median")&&v>=1&&v<=UPS_FILTER_MEDIAN_MAX) filter_conf.median = v;
+		else if (!strcmp(key,"ewma")&&v<=8) filter_conf.ewma = v;
+		else if (!strcmp(key,"pct")&&v<=UPS_FILTER_PCT_MAX) filter_conf.pct = v;
+		else if (!strcmp(key,"mv")) filter_conf.mv = v;
+		else if (!strcmp(key,"vlow")) filter_conf.vlow = v;
+		else if (!strcmp(key,"et")) filter_conf.et = v;
+		else return -1;
+		spec += n;
+		if (*spec==',') spec++;
+		else if (*spec) return -1;
 	}
+	return 0;
+}
 
-	// Setup serial device connection.
-	set_interface_attribs(serial,B9600,0);  // set speed to 115,200 bps, 8n1 (no parity)
-	set_blocking(serial,1);                // set blocking
-
-	// Setup `select` test for serial read.
-	fd_set sel_set;
-	struct timeval sel_timeout;
-	int sel_result;
-
-	FD_ZERO(&sel_set);
-	FD_SET(serial, &sel_set);
-
-	sel_timeout.tv_sec = 3;
-	sel_timeout.tv_usec = 0;
-
-	// Test connection to the UPS and update module info on successful read.
-	// Check if any data is sent by UPS from the serial port. Return -1 when nothing was received within 1 sec.
-	sel_result = select(serial+1,&sel_set,NULL,NULL,&sel_timeout);
-	if (sel_result==0) {
-		fprintf(stderr,"UPS: Read from serial device timed out. The UPS might not be online.\n");
-		close(serial);
-		return -1;
+/*
+ * A port is closed after 5 continuous failures and reopened after a backoff
+ * that starts at RECONNECT_MIN and doubles up to RECONNECT_MAX with every
+ * close or failed reopen, until a valid frame is read again. A port that opens
+ * but only sends garbage is therefore retried less and less often too. The directory of every port path is watched with
+ * inotify as well, so a device node (or a /dev/serial/by-id link) that comes
+ * back is reopened at once.
+ */
+#define RECONNECT_MIN 50000000ULL// nanoseconds
+#define RECONNECT_MAX 10000000000ULL
+
+// epoll tags of the reader besides the port indexes.
+#define READER_INOTIFY 0xffffffffU
+#define READER_SIGNAL 0xfffffffeU
+
+// One serial port. Port n drives unit n of the module.
+struct port {
+	const char *path;
+	const char *name;// Last component of path.
+	int wd;// inotify watch of the directory of path, -1 if none.
+	int fd;// -1 while closed.
+	unsigned long long failed;// Time the port was closed, 0 once a valid frame was read after reopening.
+	unsigned long long retry;// Next reopen attempt while closed.
+	unsigned long long backoff;
+	int errcount;// Reduced when parsing error occurs. Reset after each successful updates.
+	unsigned long long last;// Arrival time of the last frame.
+	unsigned long long interval;// Time between the last two frames, 0 if unknown.
+	unsigned long resyncs;// Resyncs already counted in the metrics.
+	struct ups_ring ring;
+	// Low-power mode.
+	int vmin;// Current VMIN, 0 until two frames in a row were read.
+	unsigned int start;// Ring position of the last frame, valid if seen is set.
+	int steady;// Frames in a row without a change.
+	int slow;// Read at the slow cadence instead of on arrival.
+	unsigned long long period;// Measured frame period (nanoseconds).
+	unsigned long long due;// Next slow read.
+	struct ups_frame prev;// Last processed frame.
+	int seen;// prev is valid.
+};
+
+// Serial reader thread state.
+struct reader {
+	int ep;// epoll set of all ports, the inotify fd and the signalfd.
+	int ino;// -1 if inotify is not available.
+	int sfd;
+	int nports;
+	int active;// Ports currently open.
+	struct port *ports;
+	int efd;// Signalled after every push and when the reader stops.
+	int done;
+	struct ups_queue queue;
+	unsigned long long start;// Reader start time, for the wakeup rate.
+};
+
+// Publisher state of one unit.
+struct unit {
+	int stat_l,bat_l,etchg_l,etdsc_l,ext_l,vlt_l;
+	int present;// The module has been told the battery is present.
+	int valid;// A frame has been published.
+	int restored;// saved holds the state restored from the state file, kept until a frame is published.
+	struct ups_fields saved;
+	struct ups_estimator est;
+	struct ups_filter filter;
+};
+
+/*
+ * The state file holds the last published state of every unit, one line of
+ * "<unit> <fields> <discharge rate> <charge rate>" each, where the fields are
+ * those of a batched update as UPS_STATE_FMT writes them and the rates the
+ * last ones fitted by the estimator (ms per percent, 0 if unknown). It is
+ * written to a temporary file and renamed, so a crash leaves either the old or
+ * the new snapshot. At startup it is written to the module marked stale,
+ * without the time estimates, until the UPS sends its first frame, and the
+ * rates seed the estimator so that time to empty is known as soon as the mains
+ * fail.
+ */
+static void save_state(struct unit *units,int nunits){
+	char tmp[256],line[160];
+	struct ups_fields f;
+	int fd,i,len,ok = 1;
+	static int warned;
+
+	// Written line by line from the stack, as this runs on the publisher thread.
+	snprintf(tmp,sizeof(tmp),"%s.tmp",state_file);
+	fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if (fd<0) goto failed;
+	for (i=0;i<nunits&&ok;i++) {
+		if (units[i].stat_l>=0) {
+			f.battery_status = units[i].stat_l;
+			f.battery_percentage = units[i].bat_l;
+			f.output_voltage = units[i].vlt_l;
+			f.external_online = units[i].ext_l;
+			f.et_charge = units[i].etchg_l;
+			f.et_discharge = units[i].etdsc_l;
+		}
+		// A unit that has not sent a frame since it was restored keeps its saved state.
+		else if (units[i].restored) f = units[i].saved;
+		else continue;
+		len = snprintf(line,sizeof(line),"%d " UPS_STATE_FMT "%lld %lld\n",i UPS_STATE_ARGS(f),units[i].est.per[0],units[i].est.per[1]);
+		ok = write(fd,line,len)==len;
 	}
-	else if (sel_result==-1) {
-		fprintf(stderr,"UPS: Error %d selecting on serial port %s: %s\n",errno,argv[1],strerror(errno));
-		close(serial);
-		return -1;
+	ok = ok&&!fsync(fd);
+	if (close(fd)||!ok||rename(tmp,state_file)) goto failed;
+	warned = 0;
+	return;
+failed:
+	if (!warned) log_msg("UPS: Warning: Error %d saving state to %s: %s\n",errno,state_file,strerror(errno));
+	warned = 1;
+}
+
+// Write the saved state of every unit to the module, marked stale. Returns the number of units restored.
+static int restore_state(struct unit *units,int nunits,int out_state,int out_unit_state){
+	char line[192],wbuf[96];
+	struct ups_fields fields;
+	const char *p;
+	FILE *f;
+	int unit,n = 0;
+	long long per_dsc,per_chg;
+
+	f = fopen(state_file,"re");
+	if (!f) return 0;
+	while (fgets(line,sizeof(line),f)) {
+		p = line;
+		// Parsed like a batched update, so a line the module would reject is skipped here.
+		if (ups_parse_int(&p,&unit)||unit<0||unit>=nunits||ups_parse_state(&p,&fields)) continue;
+		per_dsc = per_chg = 0;
+		// The rates are optional; without them the state is still restored.
+		sscanf(p,"%lld %lld",&per_dsc,&per_chg);
+		ups_est_seed(&units[unit].est,per_dsc,per_chg);
+		// The saved estimates are out of date by now.
+		fields.et_charge = fields.et_discharge = -1;
+		if (unit==0) sprintf(wbuf,UPS_STATE_FMT "stale" UPS_STATE_ARGS(fields));
+		else sprintf(wbuf,"%d " UPS_STATE_FMT "stale",unit UPS_STATE_ARGS(fields));
+		if (write(unit?out_unit_state:out_state,wbuf,strlen(wbuf))!=(ssize_t)strlen(wbuf)) continue;
+		if (!units[unit].present&&!upsmod_present(unit)) units[unit].present = 1;
+		units[unit].saved = fields;
+		units[unit].restored = 1;
+		n++;
 	}
+	fclose(f);
+	return n;
+}
 
-	if (upsmod_init()) {
-		fprintf(stderr, "UPS: Error %d communicating with the UPS kernel module: %s. Please check if the module is loaded and you have the proper permissions.\n",errno,strerror(errno));
-		close(serial);
+// Make a read on fd return only once vmin bytes are available.
+static void set_vmin(int fd,int vmin){
+	struct termios tty;
+
+	if (tcgetattr(fd,&tty)) return;
+	tty.c_cc[VMIN] = vmin;
+	tty.c_cc[VTIME] = 0;// Otherwise poll() reports the port readable on the first byte.
+	tcsetattr(fd,TCSANOW,&tty);
+}
+
+// Switch port i between reading on arrival and reading at the slow cadence.
+static void set_slow(struct reader *rd,int i,int slow,unsigned long long now){
+	struct port *p = &rd->ports[i];
+	struct epoll_event ev;
+
+	p->slow = slow;
+	p->due = now+p->period*lowpower;
+	ev.events = slow?0:EPOLLIN;
+	ev.data.u32 = i;
+	epoll_ctl(rd->ep,EPOLL_CTL_MOD,p->fd,&ev);
+}
+
+// Decide in low-power mode whether a frame from port i, whose payload starts at ring position off, is processed.
+static int lowpower_keep(struct reader *rd,int i,const struct ups_frame *f,unsigned int off,unsigned long long now){
+	struct port *p = &rd->ports[i];
+	unsigned int len = off-p->start;
+
+	// A frame dropped in between only makes the distance longer, so the shortest one is a single frame.
+	if (p->seen&&len<UPS_FRAME_MAX&&(!p->vmin||(int)len<p->vmin)) {
+		p->vmin = len;
+		set_vmin(p->fd,len);
+	}
+	p->start = off;
+	if (!p->seen||!f->vin||f->vin!=p->prev.vin||f->batcap!=p->prev.batcap||abs(f->vout-p->prev.vout)>=LOWPOWER_VOLT_DELTA) {
+		p->prev = *f;
+		p->seen = 1;
+		p->steady = 0;
+		if (p->slow) set_slow(rd,i,0,now);
+		return 1;
+	}
+	p->steady++;
+	if (p->steady>=lowpower&&!p->slow) set_slow(rd,i,1,now);
+	if (p->steady%lowpower) return 0;
+	p->prev = *f;
+	return 1;
+}
+
+// Open port i and add it to the epoll set. Anything parsed before is discarded.
+static int open_port(struct reader *rd,int i){
+	struct port *p = &rd->ports[i];
+	struct epoll_event ev;
+
+	p->fd = open(p->path,O_RDWR|O_NOCTTY|O_SYNC|O_NONBLOCK|O_CLOEXEC);
+	if (p->fd<0) return -1;
+
+	// Setup serial device connection.
+	set_interface_attribs(p->fd,B9600,0);  // set speed to 9600 bps, 8n1 (no parity)
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(rd->ep,EPOLL_CTL_ADD,p->fd,&ev)) {
+		close(p->fd);
+		p->fd = -1;
 		return -1;
 	}
+	p->errcount = 5;
+	ups_ring_reset(&p->ring);
+	p->last = p->interval = 0;
+	p->vmin = p->steady = p->slow = p->seen = 0;
+	rd->active++;
+	ups_metric_set(&metrics.ports_up,rd->active);
+	return 0;
+}
+
+// Retry port p after the current backoff, and back off further for the next time. Only a valid frame resets it.
+static void schedule_reopen(struct port *p,unsigned long long now){
+	p->retry = now+p->backoff;
+	p->backoff = p->backoff*2<RECONNECT_MAX?p->backoff*2:RECONNECT_MAX;
+}
 
-	// Loop condition. Reduced when parsing error occurs. Reset after each successful updates.
-	int errcount=5;
+// Close port i and schedule its reopening.
+static void close_port(struct reader *rd,int i,const char *why){
+	struct port *p = &rd->ports[i];
+	unsigned long long now = monotonic_ns();
 
-	char rbuf[100],wbuf[10],rol,*ptr;
-	int n = 0;
+	close(p->fd);// Also removes it from the epoll set.
+	p->fd = -1;
+	rd->active--;
+	ups_metric_set(&metrics.ports_up,rd->active);
+	if (!p->failed) p->failed = now;
+	log_msg("UPS: Closing %s: %s. Reopening in %.2f s.\n",p->path,why,p->backoff/1e9);
+	schedule_reopen(p,now);
+}
 
-	int out_stat,out_bat,out_etchg,out_etdsc,out_ext,out_vlt;
+// Read what is available on port i and queue every frame in it. The port is closed after 5 continuous failures or a hangup.
+static void read_port(struct reader *rd,int i){
+	struct port *p = &rd->ports[i];
+	struct ups_queue_item item;
+	unsigned int off,len;
+	char *ptr;
+	int n;
 
-	int stat,bat,etchg,etdsc,ext,vlt;
-	int stat_l,bat_l,etchg_l,etdsc_l,ext_l,vlt_l;
-	int start_percent,cur_percent;
-	time_t start_time,cur_time;
-	
-	out_stat = open(MODPATH "battery_status",O_WRONLY);
-	out_bat = open(MODPATH "battery_percentage",O_WRONLY);
-	out_etchg = open(MODPATH "et_charge",O_WRONLY);
-	out_etdsc = open(MODPATH "et_discharge",O_WRONLY);
-	out_ext = open(MODPATH "external_online",O_WRONLY);
-	out_vlt = open(MODPATH "output_voltage",O_WRONLY);
-
-	stat_l = bat_l = etchg_l = etdsc_l = ext_l = vlt_l = -1;
-
-	while (errcount) {
-		n = rol = 0;
-		memset(rbuf,0,sizeof(rbuf));
-		while (rol!='\n') read(serial,&rol,sizeof(rol));
-		while (rbuf[strlen(rbuf)-1]!='\n') n+=read(serial,rbuf+n,sizeof(rbuf)-n);
-
-		// Update battery status.
-		// Check power in
-		if (!(ptr=strstr(rbuf,"Vin"))) {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
+	while (p->errcount) {
+		// Refill the ring only once every complete frame in it has been handled.
+		if (!ups_ring_next_frame(&p->ring,&off,&len)) {
+			len = ups_ring_space(&p->ring,&ptr);
+			// Taken before the read, as the bytes were already waiting when the port was reported readable.
+			ups_ring_stamp(&p->ring,monotonic_ns());
+			n = read(p->fd,ptr,len);
+			if (n<0&&(errno==EAGAIN||errno==EINTR)) return;
+			// The device went away, e.g. a USB adapter was unplugged.
+			if (n==0||(n<0&&errno==EIO)) {
+				close_port(rd,i,"hangup");
+				return;
+			}
+			if (n<0) {
+				log_msg("UPS: Error %d reading from serial device %s: %s\n",errno,p->path,strerror(errno));
+				ups_metric_add(&metrics.read_errors,1);
+				p->errcount--;
+				continue;
+			}
+			ups_ring_commit(&p->ring,n);
+			ups_metric_add(&metrics.bytes,n);
 			continue;
 		}
-		if (strstr(ptr,"GOOD")) ext=1;
-		else if (strstr(ptr,"NG")) ext=0;
-		else {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
+		ups_metric_add(&metrics.resyncs,p->ring.resyncs-p->resyncs);
+		p->resyncs=p->ring.resyncs;
+		if (ups_ring_parse(&p->ring,off,len,&item.frame)) {
+			log_msg("UPS: Warning: Corrupted message received from %s.\n",p->path);
+			ups_metric_add(&metrics.corrupted,1);
+			p->errcount--;
 			continue;
 		}
-		// Check battery percentage
-		if (!(ptr=strstr(ptr,"BATCAP"))) {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
-			continue;
+		item.t=monotonic_ns();
+		item.rx=ups_ring_frame_time(&p->ring,off);
+		item.boot=item.rx+boottime_ns()-monotonic_ns();
+		item.unit=i;
+		ups_metric_add(&metrics.frames,1);
+		// Frames read in a batch at the slow cadence say nothing about the arrival times.
+		if (!p->slow) {
+			if (p->last) {
+				ups_hist_observe(&metrics.interarrival,item.rx-p->last);
+				// Change of the inter-arrival time from the previous frame, which is what a UART stall or a late wakeup shows as.
+				if (p->interval) ups_hist_observe(&metrics.jitter,item.rx-p->last>p->interval?item.rx-p->last-p->interval:p->interval-(item.rx-p->last));
+				p->interval=item.rx-p->last;
+				if (p->interval>=LOWPOWER_PERIOD/100) p->period=p->interval;
+			}
+			p->last=item.rx;
 		}
-		if (EOF==sscanf(ptr+6,"%d",&bat)) {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
-			continue;
+		else p->last=p->interval=0;
+		p->errcount=5;
+		if (p->failed) {
+			log_msg("UPS: %s: Recovered %.1f ms after it failed.\n",p->path,(item.t-p->failed)/1e6);
+			ups_hist_observe(&metrics.recovery,item.t-p->failed);
+			p->failed=0;
+			p->backoff=RECONNECT_MIN;
 		}
-		// Check power out
-		if (!(ptr=strstr(ptr,"Vout"))) {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
+		if (lowpower&&!lowpower_keep(rd,i,&item.frame,off,item.t)) {
+			ups_metric_add(&metrics.skipped,1);
 			continue;
 		}
-		if (EOF==sscanf(ptr+4,"%d",&vlt)) {
-			fprintf(stderr,"UPS: Warning: Corrupted message received.\n");
-			errcount--;
-			continue;
+		if (!ups_queue_push(&rd->queue,&item)) eventfd_write(rd->efd,1);
+		else ups_metric_add(&metrics.queue_drops,1);
+	}
+	close_port(rd,i,"5 continuous communication failures");
+}
+
+// Try to reopen the closed port i, backing off further when that fails.
+static void reopen_port(struct reader *rd,int i){
+	struct port *p = &rd->ports[i];
+
+	if (!open_port(rd,i)) {
+		ups_metric_add(&metrics.reconnects,1);
+		log_msg("UPS: Reopened %s %.1f ms after it failed.\n",p->path,(monotonic_ns()-p->failed)/1e6);
+		read_port(rd,i);// Anything that arrived in between.
+		return;
+	}
+	schedule_reopen(p,monotonic_ns());
+}
+
+// Reopen closed ports whose device node was just created, renamed into place or made accessible.
+static void handle_inotify(struct reader *rd){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *ptr;
+	int i;
+
+	while ((n = read(rd->ino,buf,sizeof(buf)))>0) {
+		for (ptr=buf;ptr<buf+n;ptr+=sizeof(*ev)+ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			if (!ev->len) continue;
+			for (i=0;i<rd->nports;i++)
+				if (rd->ports[i].fd<0&&rd->ports[i].wd==ev->wd&&!strcmp(rd->ports[i].name,ev->name)) reopen_port(rd,i);
 		}
-		// Update battery status
-		if (vlt<5200) stat=3;
-		else if (ext) {
-			if (bat==100) stat=4;
-			else stat=1;
+	}
+}
+
+// Read and parse frames from every serial port and hand them to the publisher. Nothing on this path blocks on a sink.
+// Runs until SIGINT or SIGTERM; failed ports are reopened.
+void *serial_reader(void *arg){
+	struct reader *rd = arg;
+	struct epoll_event events[32];
+	struct signalfd_siginfo si;
+	unsigned long long now,due;
+	int n,i,timeout,stop = 0;
+	struct port *p;
+
+	rd->start = monotonic_ns();
+	while (!stop) {
+		// Sleep until the next slow read or reopen attempt is due.
+		timeout = -1;
+		now = monotonic_ns();
+		for (i=0;i<rd->nports;i++) {
+			p = &rd->ports[i];
+			if (p->fd<0) due = p->retry;
+			else if (p->slow) due = p->due;
+			else continue;
+			due = due>now?(due-now+999999)/1000000:0;
+			if (timeout<0||(int)due<timeout) timeout = due;
 		}
-		else stat=2;
-		// Update charge/discharge time estimation
-		if (stat!=stat_l) {
-			time(&start_time);
-			start_percent=bat;
-			etchg=etdsc=-1;
+		n = epoll_wait(rd->ep,events,32,timeout);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			log_msg("UPS: Error %d waiting for serial devices: %s\n",errno,strerror(errno));
+			break;
 		}
-		else if (bat!=bat_l) {
-			time(&cur_time);
-			cur_percent=bat;
-			if (start_time!=cur_time&&abs(start_percent-cur_percent)>1) {
-				if (ext) {
-					etchg = (100-bat)*(cur_time-start_time)/(cur_percent-start_percent-1);
-					etdsc = -1;
-				}
-				else {
-					etchg = -1;
-					etdsc = bat*(cur_time-start_time)/(start_percent-cur_percent-1);
-				}
+		ups_metric_add(&metrics.wakeups,1);
+		for (i=0;i<n;i++) {
+			if (events[i].data.u32==READER_SIGNAL) {
+				if (read(rd->sfd,&si,sizeof(si))==sizeof(si)) log_msg("UPS: Exiting on signal %u.\n",si.ssi_signo);
+				stop = 1;
 			}
+			else if (events[i].data.u32==READER_INOTIFY) handle_inotify(rd);
+			else if (rd->ports[events[i].data.u32].fd>=0) read_port(rd,events[i].data.u32);
 		}
-
-		// Move current values to last records.
-		if (stat_l!=stat) {
-			write(out_stat,BATSTAT[stat],strlen(BATSTAT[stat]));
-			stat_l=stat;
+		now = monotonic_ns();
+		for (i=0;i<rd->nports;i++) {
+			p = &rd->ports[i];
+			if (p->fd<0) {
+				if (p->retry<=now) reopen_port(rd,i);
+			}
+			else if (p->slow&&p->due<=now) {
+				p->due = now+p->period*lowpower;
+				read_port(rd,i);
+			}
 		}
-		if (bat_l!=bat) {
-			sprintf(wbuf,"%d",bat);
-			write(out_bat,wbuf,strlen(wbuf));
-			bat_l=bat;
+	}
+	__atomic_store_n(&rd->done,1,__ATOMIC_RELEASE);
+	eventfd_write(rd->efd,1);
+	return NULL;
+}
+
+static void close_ports(struct reader *rd){
+	int i;
+
+	for (i=0;i<rd->nports;i++)
+		if (rd->ports[i].fd>=0) close(rd->ports[i].fd);
+}
+
+// Touch the stack the publisher will use, so that mlockall() locks it in.
+static void rt_prefault(){
+	char stack[RT_PREFAULT];
+
+	memset(stack,0,sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory");// Keeps the memset.
+}
+
+// Lock memory and switch the calling thread, and the threads it creates with attr, to real-time operation. Failures only print warnings.
+static void rt_init(pthread_attr_t *attr){
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int err;
+
+	pthread_attr_setstacksize(attr,RT_STACK_SIZE);
+	rt_prefault();
+	if (mlockall(MCL_CURRENT|MCL_FUTURE)) fprintf(stderr,"UPS: Warning: Error %d locking memory: %s\n",errno,strerror(errno));
+	if (rt_cpu>=0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(rt_cpu,&cpus);
+		if (sched_setaffinity(0,sizeof(cpus),&cpus)) fprintf(stderr,"UPS: Warning: Error %d pinning to CPU %d: %s\n",errno,rt_cpu,strerror(errno));
+	}
+	if (rt>0) {
+		sp.sched_priority = rt;
+		err = pthread_setschedparam(pthread_self(),SCHED_FIFO,&sp);
+		if (err) fprintf(stderr,"UPS: Warning: Error %d setting SCHED_FIFO priority %d: %s\n",err,rt,strerror(err));
+	}
+	fcntl(STDERR_FILENO,F_SETFL,fcntl(STDERR_FILENO,F_GETFL)|O_NONBLOCK);
+}
+
+int main(int argc,char *argv[]){
+	// Parse command line arguments for serial device paths. Every path is one UPS.
+	if (argc<2) {
+		fprintf(stderr,"UPS: Invalid arguments!\n");
+		return(-1);
+	}
+	unsigned long long start = monotonic_ns();
+	if (getenv("UPS_MODPATH")) modpath = getenv("UPS_MODPATH");
+	if (getenv("UPS_STATE_FILE")) state_file = getenv("UPS_STATE_FILE");
+	if (!strcmp(state_file,"off")) state_file = NULL;
+	if (getenv("UPS_LOG")&&*getenv("UPS_LOG")) log_file = getenv("UPS_LOG");
+	if (getenv("UPS_LOWPOWER")) {
+		lowpower = atoi(getenv("UPS_LOWPOWER"));
+		if (lowpower<2) lowpower = 0;
+		if (lowpower>LOWPOWER_MAX) lowpower = LOWPOWER_MAX;
+	}
+	if (getenv("UPS_RT")&&*getenv("UPS_RT")) {
+		rt = atoi(getenv("UPS_RT"));
+		if (rt<0) rt = 0;
+		if (rt>99) rt = 99;
+	}
+	if (getenv("UPS_RT_CPU")) rt_cpu = atoi(getenv("UPS_RT_CPU"));
+	if (getenv("UPS_FILTER")&&parse_filter(getenv("UPS_FILTER")))
+		fprintf(stderr,"UPS: Warning: Invalid UPS_FILTER setting %s.\n",getenv("UPS_FILTER"));
+
+	// The serial ports are read on their own thread; this thread publishes what they parsed.
+	static struct reader reader;
+	struct epoll_event pev;
+	struct port *p;
+	char dir[256];
+	sigset_t sigs;
+	int i;
+
+	// SIGINT and SIGTERM stop the reader through a signalfd; every other thread inherits the mask.
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGINT);
+	sigaddset(&sigs,SIGTERM);
+	pthread_sigmask(SIG_BLOCK,&sigs,NULL);
+
+	reader.nports = argc-1;
+	reader.ports = calloc(reader.nports,sizeof(struct port));
+	reader.ep = epoll_create1(EPOLL_CLOEXEC);
+	reader.sfd = signalfd(-1,&sigs,SFD_NONBLOCK|SFD_CLOEXEC);
+	pev.events = EPOLLIN;
+	pev.data.u32 = READER_SIGNAL;
+	if (!reader.ports||reader.ep<0||reader.sfd<0||epoll_ctl(reader.ep,EPOLL_CTL_ADD,reader.sfd,&pev)) {
+		fprintf(stderr,"UPS: Error %d setting up serial devices: %s\n",errno,strerror(errno));
+		return -1;
+	}
+	reader.ino = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	pev.data.u32 = READER_INOTIFY;
+	if (reader.ino>=0&&epoll_ctl(reader.ep,EPOLL_CTL_ADD,reader.ino,&pev)) {
+		close(reader.ino);
+		reader.ino = -1;
+	}
+	if (reader.ino<0) fprintf(stderr,"UPS: Warning: Error %d setting up inotify: %s. Failed ports are only retried periodically.\n",errno,strerror(errno));
+	for (i=0;i<reader.nports;i++) reader.ports[i].fd = -1;
+	for (i=0;i<reader.nports;i++) {
+		p = &reader.ports[i];
+		p->path = argv[i+1];
+		p->name = strrchr(p->path,'/')?strrchr(p->path,'/')+1:p->path;
+		p->period = LOWPOWER_PERIOD;
+		p->backoff = RECONNECT_MIN;
+		ups_ring_init(&p->ring);
+
+		// Watch the directory for the device node coming back.
+		if (p->name>p->path) snprintf(dir,sizeof(dir),"%.*s",(int)(p->name-p->path),p->path);
+		else strcpy(dir,".");
+		p->wd = reader.ino>=0?inotify_add_watch(reader.ino,dir,IN_CREATE|IN_MOVED_TO|IN_ATTRIB):-1;
+
+		// The module is told the UPS is there once its first valid frame arrives, so nothing waits for it here.
+		// A port that cannot be opened yet, e.g. a USB adapter that is still being set up, is retried like a failed one.
+		if (open_port(&reader,i)) {
+			fprintf(stderr,"UPS: Error %d opening %s: %s\n",errno,p->path,strerror(errno));
+			p->failed = monotonic_ns();
+			p->retry = p->failed+p->backoff;
 		}
-		if (etchg_l!=etchg) {
-			sprintf(wbuf,"%d",etchg);
-			write(out_etchg,wbuf,strlen(wbuf));
-			etchg_l=etchg;
+	}
+
+	if (upsmod_init()) {
+		fprintf(stderr, "UPS: Error %d communicating with the UPS kernel module: %s. Please check if the module is loaded and you have the proper permissions.\n",errno,strerror(errno));
+		close_ports(&reader);
+		return -1;
+	}
+
+	struct ups_queue_item item;
+	pthread_t reader_thread;
+	pthread_attr_t reader_attr;
+	eventfd_t ev;
+	char wbuf[96];
+	struct ups_fields fields;
+	static struct ups_exporter exporter;
+
+#ifdef UPS_TEST
+	// Test builds only: artificial delay before every sysfs write, to check that slow sinks do not affect the serial path.
+	int sink_delay = getenv("UPS_SINK_DELAY_MS")?atoi(getenv("UPS_SINK_DELAY_MS")):0;
+#endif
+
+	int out_state,out_unit_state = -1;
+
+	int stat,bat,etchg,etdsc,ext,vlt,save;
+	struct unit *units,*u;
+	unsigned long long now,wall,saved = 0;
+	struct timespec boot;
+	static struct ups_log tlog;
+	struct ups_log_sample sample;
+	int flush,timeout,ready;
+
+	// Every sample of the first UPS is also published to the shared-memory status board.
+	struct ups_board *board;
+	struct ups_board_data bdata;
+
+	board = ups_board_create(ups_board_name());
+	if (!board) fprintf(stderr,"UPS: Warning: Error %d creating status board %s: %s\n",errno,ups_board_name(),strerror(errno));
+	memset(&bdata,0,sizeof(bdata));
+
+	reader.efd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	ups_queue_init(&reader.queue);
+
+	// State changes of the first UPS are pushed to subscribers on a Unix socket, served from the same epoll loop that waits for samples.
+	static struct ups_server server;
+	if (reader.efd<0||ups_server_init(&server,reader.efd,ups_server_path())) {
+		fprintf(stderr,"UPS: Error %d setting up epoll: %s\n",errno,strerror(errno));
+		close_ports(&reader);
+		return -1;
+	}
+	
+	// All fields of a unit are committed to the module together through a single parameter.
+	out_state = open_param("state");
+	if (reader.nports>1) out_unit_state = open_param("unit_state");
+
+	units = calloc(reader.nports,sizeof(struct unit));
+	if (!units) {
+		fprintf(stderr,"UPS: Error %d allocating unit state: %s\n",errno,strerror(errno));
+		close_ports(&reader);
+		return -1;
+	}
+	for (i=0;i<reader.nports;i++) {
+		u = &units[i];
+		u->stat_l = u->bat_l = u->etchg_l = u->etdsc_l = u->ext_l = u->vlt_l = -1;
+		ups_est_init(&u->est);
+		ups_filter_reset(&u->filter);
+	}
+	if (state_file&&(i = restore_state(units,reader.nports,out_state,out_unit_state)))
+		fprintf(stderr,"UPS: Restored the saved state of %d unit(s) from %s %.1f ms after start.\n",i,state_file,(monotonic_ns()-start)/1e6);
+
+	if (log_file&&ups_log_open(&tlog,log_file,(getenv("UPS_LOG_FLUSH")?atoi(getenv("UPS_LOG_FLUSH")):LOG_FLUSH_INTERVAL)*1000ULL)) {
+		fprintf(stderr,"UPS: Warning: Error %d opening telemetry log %s: %s\n",errno,log_file,strerror(errno));
+		log_file = NULL;
+	}
+
+	// The exporter is started first so that it keeps the normal scheduling class. Nothing below allocates in the steady state.
+	ups_exporter_start(&exporter,&metrics);
+	pthread_attr_init(&reader_attr);
+	if (rt>=0) rt_init(&reader_attr);
+	if (pthread_create(&reader_thread,&reader_attr,serial_reader,&reader)) {
+		fprintf(stderr,"UPS: Error starting serial reader thread.\n");
+		close_ports(&reader);
+		return -1;
+	}
+	while (1) {
+		// Logged samples are flushed within the interval also when the UPS falls silent after them.
+		timeout=-1;
+		if (log_file&&!(timeout=ups_log_due(&tlog,wall=realtime_ms()))) {
+			if (ups_log_flush(&tlog,wall)) log_msg("UPS: Error %d writing telemetry log %s: %s\n",errno,log_file,strerror(errno));
+			timeout=-1;
 		}
-		if (etdsc_l!=etdsc) {
-			sprintf(wbuf,"%d",etdsc);
-			write(out_etdsc,wbuf,strlen(wbuf));
-			etdsc_l=etdsc;
+		if (ups_queue_pop(&reader.queue,&item)) {
+			// The reader sets done after its last push, so an empty queue seen afterwards stays empty.
+			if (__atomic_load_n(&reader.done,__ATOMIC_ACQUIRE)) {
+				if (ups_queue_pop(&reader.queue,&item)) break;
+			}
+			else if ((ready=ups_server_wait(&server,timeout))<0) {
+				log_msg("UPS: Error %d waiting for samples: %s\n",errno,strerror(errno));
+				pthread_cancel(reader_thread);
+				break;
+			}
+			else {
+				if (ready) {
+					ups_metric_add(&metrics.wakeups,1);
+					eventfd_read(reader.efd,&ev);
+				}
+				continue;
+			}
 		}
-		if (ext_l!=ext) {
-			sprintf(wbuf,"%d",ext);
-			write(out_ext,wbuf,strlen(wbuf));
-			ext_l=ext;
+		u = &units[item.unit];
+		struct ups_frame frame=item.frame;
+		// Filter the readings and update battery status
+		stat=ups_filter_frame(&u->filter,&filter_conf,&frame);
+		ext=frame.vin;
+		bat=frame.batcap;
+		vlt=frame.vout;
+		// Update charge/discharge time estimation. The regression gets the raw percentage, as it averages the noise out itself.
+		now=item.t;
+		// The estimate runs on CLOCK_BOOTTIME, so that a suspend counts as time the battery was in use.
+		ups_est_update(&u->est,item.boot/1000000,item.frame.batcap,ext,&etchg,&etdsc);
+		ups_filter_estimates(&u->filter,&filter_conf,&etchg,&etdsc);
+
+		if (item.unit==0) {
+			if (board) {
+				bdata.updates++;
+				bdata.timestamp=item.rx;
+				bdata.status=stat;
+				bdata.percentage=bat;
+				bdata.voltage=vlt;
+				bdata.external_online=ext;
+				bdata.et_charge=etchg;
+				bdata.et_discharge=etdsc;
+				memcpy(bdata.version,frame.version,sizeof(bdata.version));
+				ups_board_write(board,&bdata);
+			}
+			ups_server_publish(&server,ups_status_name(stat),stat,bat,vlt,ext,etchg,etdsc);
+			ups_metric_set(&metrics.status,stat);
+			ups_metric_set(&metrics.percentage,bat);
+			ups_metric_set(&metrics.voltage,vlt);
+			ups_metric_set(&metrics.external_online,ext);
+			ups_metric_set(&metrics.et_charge,etchg);
+			ups_metric_set(&metrics.et_discharge,etdsc);
+			ups_metric_set(&metrics.subscribers,server.nclients);
 		}
-		if (vlt_l!=vlt) {
-			sprintf(wbuf,"%d",vlt);
-			write(out_vlt,wbuf,strlen(wbuf));
-			vlt_l=vlt;
+
+		// Publish the sample when anything changed and move current values to last records. The first one also clears a restored stale state.
+		if (u->stat_l!=stat||u->bat_l!=bat||u->etchg_l!=etchg||u->etdsc_l!=etdsc||u->ext_l!=ext||u->vlt_l!=vlt) {
+			if (!u->present&&!upsmod_present(item.unit)) u->present=1;
+#ifdef UPS_TEST
+			if (sink_delay) usleep(sink_delay*1000);
+#endif
+			fields.battery_status=stat;
+			fields.battery_percentage=bat;
+			fields.output_voltage=vlt;
+			fields.external_online=ext;
+			fields.et_charge=etchg;
+			fields.et_discharge=etdsc;
+			if (item.unit==0) {
+				sprintf(wbuf,UPS_STATE_FMT "@%llu" UPS_STATE_ARGS(fields),item.rx);
+				if (write(out_state,wbuf,strlen(wbuf))!=(ssize_t)strlen(wbuf)) ups_metric_add(&metrics.sysfs_failures,1);
+			}
+			else {
+				sprintf(wbuf,"%d " UPS_STATE_FMT "@%llu",item.unit UPS_STATE_ARGS(fields),item.rx);
+				if (write(out_unit_state,wbuf,strlen(wbuf))!=(ssize_t)strlen(wbuf)) ups_metric_add(&metrics.sysfs_failures,1);
+			}
+			// Status changes are saved at once, anything else at most every STATE_SAVE_INTERVAL.
+			save=state_file&&(u->stat_l!=stat||u->ext_l!=ext||now-saved>=STATE_SAVE_INTERVAL);
+			// The log is flushed at once on mains loss, as the power may not last until the next interval.
+			flush=u->ext_l==1&&ext==0;
+			u->stat_l=stat;
+			u->bat_l=bat;
+			u->etchg_l=etchg;
+			u->etdsc_l=etdsc;
+			u->ext_l=ext;
+			u->vlt_l=vlt;
+			if (save) {
+				save_state(units,reader.nports);
+				saved=now;
+			}
+			if (log_file) {
+				sample.time=realtime_ms()-(monotonic_ns()-item.rx)/1000000;
+				sample.unit=item.unit;
+				sample.status=stat;
+				sample.percentage=bat;
+				sample.voltage=vlt;
+				sample.external_online=ext;
+				sample.et_charge=etchg;
+				sample.et_discharge=etdsc;
+				if (ups_log_append(&tlog,&sample)||(flush&&ups_log_flush(&tlog,sample.time)))
+					log_msg("UPS: Error %d writing telemetry log %s: %s\n",errno,log_file,strerror(errno));
+			}
+			if (!u->valid) {
+				u->valid=1;
+				clock_gettime(CLOCK_BOOTTIME,&boot);
+				log_msg("UPS: %s: Valid state published %.1f ms after start, %.2f s after boot.\n",
+					reader.ports[item.unit].path,(monotonic_ns()-start)/1e6,boot.tv_sec+boot.tv_nsec/1e9);
+			}
 		}
-		errcount=5;
-	}
-	close(out_stat);
-	close(out_etchg);
-	close(out_etdsc);
-	close(out_ext);
-	close(out_vlt);
-	close(serial);
-	fprintf(stderr,"UPS: Exited after 5 continuous communication failures.\n");
+		ups_metric_add(&metrics.published,1);
+		ups_hist_observe(&metrics.latency,monotonic_ns()-item.t);
+	}
+	pthread_join(reader_thread,NULL);
+	if (state_file) save_state(units,reader.nports);
+	if (log_file) ups_log_close(&tlog,realtime_ms());
+	close(out_state);
+	if (out_unit_state>=0) close(out_unit_state);
+	ups_server_close(&server,ups_server_path());
+	close_ports(&reader);
+	for (i=0;i<reader.nports;i++) {
+		p = &reader.ports[i];
+		fprintf(stderr,"UPS: %s: %lu bytes received, %lu frames, %lu resyncs.\n",p->path,p->ring.bytes,p->ring.frames,p->ring.resyncs);
+	}
+	fprintf(stderr,"UPS: %lu samples dropped, maximum backlog %u.\n",reader.queue.drops,reader.queue.max_backlog);
+	fprintf(stderr,"UPS: %.2f wakeups/s, %llu frames skipped in low-power mode.\n",
+		metrics.wakeups/((monotonic_ns()-reader.start)/1e9),(unsigned long long)metrics.skipped);
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,127 @@
+/*
+ * Time-to-empty/time-to-full estimation for the UPSPack V3.
+ *
+ * The battery percentage is fitted against time by least squares over a
+ * sliding window of recent samples. Running sums are kept so that each sample
+ * costs O(1), and times are kept relative to the oldest sample in the window
+ * so that the sums stay well inside 64 bits. The window restarts whenever the
+ * external power state changes, as the slope changes sign.
+ *
+ * A fresh window needs a few samples and a visible change of the percentage
+ * before it gives a rate. Until then the last rate fitted in the same power
+ * state is used, which UPS_comm keeps across restarts in its state file, or
+ * for discharging with no rate known yet a nominal one. This way time to
+ * empty is available from the first sample after mains loss.
+ *
+ * Like UPS_frame.h this header has no libc dependency and is shared by the
+ * daemon and the kernel module.
+ */
+
+#ifndef UPS_ESTIMATE_H
+#define UPS_ESTIMATE_H
+
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#define UPS_EST_DIV(a,b) div64_s64(a,b)
+#else
+#define UPS_EST_DIV(a,b) ((a)/(b))
+#endif
+
+#define UPS_EST_WINDOW 256// Samples in the window. Must be a power of 2.
+#define UPS_EST_MAX_SPAN 3600000LL// Samples older than this (ms) leave the window.
+#define UPS_EST_MIN_SAMPLES 8// Samples needed before an estimate is made.
+#define UPS_EST_MIN_SPAN 30000LL// Time (ms) the window must cover before an estimate is made.
+#define UPS_EST_MAX_PER 1000000000LL// Slower rates (ms per percent) are treated as flat.
+#define UPS_EST_NOMINAL_DSC 266400LL// Discharge rate (ms per percent) of the default 37 Wh battery at a 5 W load.
+
+struct ups_estimator {
+	unsigned long long t[UPS_EST_WINDOW];// Sample times (ms).
+	int y[UPS_EST_WINDOW];// Battery percentage.
+	unsigned int head,n;
+	unsigned long long base;// Time of the oldest sample; x = t-base.
+	long long sx,sy,sxx,sxy;
+	int ext;
+	long long per[2];// Last rate fitted while discharging and charging (ms per percent), 0 if unknown.
+};
+
+static inline void ups_est_reset(struct ups_estimator *e,int ext){
+	e->head = e->n = 0;
+	e->base = 0;
+	e->sx = e->sy = e->sxx = e->sxy = 0;
+	e->ext = ext;
+}
+
+static inline void ups_est_init(struct ups_estimator *e){
+	ups_est_reset(e,-1);
+	e->per[0] = e->per[1] = 0;
+}
+
+// Set the rates used until the window gives its own, e.g. the ones saved by a previous run. 0 leaves a rate unknown.
+static inline void ups_est_seed(struct ups_estimator *e,long long per_dsc,long long per_chg){
+	e->per[0] = per_dsc>0&&per_dsc<=UPS_EST_MAX_PER?per_dsc:0;
+	e->per[1] = per_chg>0&&per_chg<=UPS_EST_MAX_PER?per_chg:0;
+}
+
+// Remove the oldest sample and move the time origin to the next one.
+static inline void ups_est_evict(struct ups_estimator *e){
+	unsigned int old = (e->head-e->n)&(UPS_EST_WINDOW-1);
+	long long x = e->t[old]-e->base,d;
+
+	e->sx -= x;
+	e->sy -= e->y[old];
+	e->sxx -= x*x;
+	e->sxy -= x*e->y[old];
+	if (--e->n==0) {
+		e->sx = e->sy = e->sxx = e->sxy = 0;
+		return;
+	}
+	// x' = x-d for every remaining sample.
+	d = e->t[(old+1)&(UPS_EST_WINDOW-1)]-e->base;
+	e->sxx += -2*d*e->sx+(long long)e->n*d*d;
+	e->sxy -= d*e->sy;
+	e->sx -= (long long)e->n*d;
+	e->base += d;
+}
+
+/*
+ * Add a sample taken at monotonic time t (ms) and update the estimates in
+ * seconds; -1 is stored when no estimate is available.
+ */
+static inline void ups_est_update(struct ups_estimator *e,unsigned long long t,int bat,int ext,int *etchg,int *etdsc){
+	long long x,num,den,per;
+
+	if (ext!=e->ext||(e->n&&t<e->t[(e->head-1)&(UPS_EST_WINDOW-1)])) ups_est_reset(e,ext);
+	while (e->n&&(e->n==UPS_EST_WINDOW||t-e->base>UPS_EST_MAX_SPAN)) ups_est_evict(e);
+	if (!e->n) e->base = t;
+
+	x = t-e->base;
+	e->t[e->head] = t;
+	e->y[e->head] = bat;
+	e->head = (e->head+1)&(UPS_EST_WINDOW-1);
+	e->n++;
+	e->sx += x;
+	e->sy += bat;
+	e->sxx += x*x;
+	e->sxy += x*bat;
+
+	*etchg = *etdsc = -1;
+	per = 0;
+	if (e->n>=UPS_EST_MIN_SAMPLES&&x>=UPS_EST_MIN_SPAN) {
+		// slope = num/den in percent per ms.
+		num = (long long)e->n*e->sxy-e->sx*e->sy;
+		den = (long long)e->n*e->sxx-e->sx*e->sx;
+		if (den>0&&(ext?num>0:num<0)) {
+			per = UPS_EST_DIV(den,ext?num:-num);// ms per percent
+			if (per>UPS_EST_MAX_PER) per = 0;
+			else e->per[!!ext] = per;
+		}
+	}
+	// No rate from the window yet: fall back to the last known one.
+	if (!per) per = e->per[!!ext];
+	if (!per&&!ext) per = UPS_EST_NOMINAL_DSC;
+	if (!per) return;
+	if (ext) *etchg = UPS_EST_DIV((100-bat)*per,1000);
+	else *etdsc = UPS_EST_DIV(bat*per,1000);
+}
+
+#endif
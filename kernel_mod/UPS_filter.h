@@ -0,0 +1,121 @@
+/*
+ * Noise filtering of the UPSPack V3 readings.
+ *
+ * BATCAP flickers between adjacent percentages and Vout wanders around the
+ * UPS_VOUT_LOW threshold, and every flicker would otherwise be published.
+ * Both readings go through a running median, which removes single spikes,
+ * then an exponentially weighted moving average kept in 1/256 units. The
+ * average reaches a steady reading exactly, and the published value moves
+ * once the average is half a unit plus a hysteresis band away from it. The
+ * band of the percentage is at most half a unit, so that a steady 1% step is
+ * always published. The not-charging status has its own band: it is entered
+ * when the averaged voltage drops below UPS_VOUT_LOW and left once it is back
+ * above UPS_VOUT_LOW plus the band. Time estimates are only republished when
+ * they move by more than a given fraction.
+ *
+ * External power is never filtered, so mains loss is published at once.
+ *
+ * Like UPS_frame.h this header has no libc dependency.
+ */
+
+#ifndef UPS_FILTER_H
+#define UPS_FILTER_H
+
+#include "UPS_frame.h"
+
+#define UPS_FILTER_MEDIAN_MAX 9
+#define UPS_FILTER_PCT_MAX 50
+
+struct ups_filter_conf {
+	int median;// Median window in samples, 1 to UPS_FILTER_MEDIAN_MAX. 1 disables it.
+	int ewma;// The average moves by 1/2^ewma of the difference per sample. 0 disables it.
+	int pct;// Hysteresis of the percentage, in hundredths of a percent, 0 to UPS_FILTER_PCT_MAX.
+	int mv;// Hysteresis of the voltage (mV).
+	int vlow;// Band above UPS_VOUT_LOW to leave the not-charging status (mV).
+	int et;// Change of a time estimate that is republished, in percent of the published one.
+};
+
+#define UPS_FILTER_DEFAULTS {5,2,50,20,20,5}
+#define UPS_FILTER_OFF {1,0,0,0,0,0}
+
+// One filtered reading.
+struct ups_filter_chan {
+	int win[UPS_FILTER_MEDIAN_MAX];
+	int n,pos;
+	long long avg;// Average <<8.
+	int held;// Published value.
+};
+
+struct ups_filter {
+	int init;
+	struct ups_filter_chan pct,mv;
+	int not_charging;
+	int etc,etd;// Published estimates.
+};
+
+static inline void ups_filter_reset(struct ups_filter *f){
+	f->init = 0;
+}
+
+static inline int ups_filter_median(struct ups_filter_chan *c,int size,int x){
+	int s[UPS_FILTER_MEDIAN_MAX];
+	int i,j,v;
+
+	c->win[c->pos] = x;
+	c->pos = (c->pos+1)%size;
+	if (c->n<size) c->n++;
+	// Insertion sort of a copy; the window is tiny.
+	for (i=0;i<c->n;i++) {
+		v = c->win[i];
+		for (j=i;j>0&&s[j-1]>v;j--) s[j] = s[j-1];
+		s[j] = v;
+	}
+	return s[c->n/2];
+}
+
+// Feed reading x and return the value to publish. band is the hysteresis in 1/256 units.
+static inline int ups_filter_chan_update(struct ups_filter_chan *c,const struct ups_filter_conf *conf,int init,int x,long long band){
+	long long d;
+
+	if (!init) {
+		c->n = c->pos = 0;
+		c->avg = (long long)x<<8;
+		c->held = x;
+	}
+	x = ups_filter_median(c,conf->median,x);
+	// The truncated step stops up to 2^ewma-1 short of x, so the rest is taken whole.
+	d = ((long long)x<<8)-c->avg;
+	c->avg += d>-(1<<conf->ewma)&&d<(1<<conf->ewma)?d:d/(1<<conf->ewma);
+	d = c->avg-((long long)c->held<<8);
+	if (d>=128+band||d<=-128-band) c->held = (int)((c->avg+128)>>8);
+	return c->held;
+}
+
+static inline int ups_filter_et(int *held,int x,int pct){
+	long long band = (long long)*held*pct/100;
+
+	if (x<0||*held<0||x-*held>band||*held-x>band) *held = x;
+	return *held;
+}
+
+// Filter the readings of frame fr in place and return its status.
+static inline int ups_filter_frame(struct ups_filter *f,const struct ups_filter_conf *conf,struct ups_frame *fr){
+	fr->batcap = ups_filter_chan_update(&f->pct,conf,f->init,fr->batcap,conf->pct*256LL/100);
+	fr->vout = ups_filter_chan_update(&f->mv,conf,f->init,fr->vout,conf->mv*256LL);
+	if (!f->init) f->not_charging = f->mv.avg<(long long)UPS_VOUT_LOW<<8;
+	else if (f->mv.avg<(long long)UPS_VOUT_LOW<<8) f->not_charging = 1;
+	else if (f->mv.avg>=(long long)(UPS_VOUT_LOW+conf->vlow)<<8) f->not_charging = 0;
+	if (!f->init) f->etc = f->etd = -1;
+	f->init = 1;
+	if (f->not_charging) return UPS_STATUS_NOT_CHARGING;
+	if (fr->vin) return fr->batcap==100?UPS_STATUS_FULL:UPS_STATUS_CHARGING;
+	return UPS_STATUS_DISCHARGING;
+}
+
+// Filter the time estimates.
+static inline void ups_filter_estimates(struct ups_filter *f,const struct ups_filter_conf *conf,int *etc,int *etd){
+	*etc = ups_filter_et(&f->etc,*etc,conf->et);
+	*etd = ups_filter_et(&f->etd,*etd,conf->et);
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Framing layer for the UPSPack V3 serial protocol.
+ *
+ * The UPS sends one status frame per line, e.g.
+ *   $ SmartUPS V3.2P,Vin GOOD,BATCAP 87,Vout 5250 $
+ * Received bytes are collected in a fixed ring buffer and frames are located in
+ * place, so nothing is moved once it has been read from the port and several
+ * frames can be handled per read(). The payload is then parsed in a single
+ * bounds-checked pass straight out of the ring.
+ *
+ * The caller may stamp every chunk it commits with the time it was read, so
+ * that a frame can be given the arrival time of its first byte rather than
+ * the time it was complete.
+ *
+ * This header has no libc dependency so that it can be shared by every tool.
+ */
+
+#ifndef UPS_FRAME_H
+#define UPS_FRAME_H
+
+#define UPS_RING_SIZE 256// Must be a power of 2.
+#define UPS_RING_MASK (UPS_RING_SIZE-1)
+#define UPS_FRAME_MAX 96// Longest payload accepted between the delimiters.
+#define UPS_VERSION_MAX 16// Including the terminating NUL.
+#define UPS_RING_STAMPS 16// Chunks whose arrival time is remembered. Must be a power of 2.
+#define UPS_VOUT_LOW 5200// Output voltage (mV) below which the UPS is considered not charging.
+
+struct ups_ring {
+	char buf[UPS_RING_SIZE];
+	unsigned int head;// Write position. All positions are free running.
+	unsigned int tail;// First byte still in use.
+	unsigned int scan;// Next byte to be examined.
+	int in_frame;
+	int skipped;// Garbage was discarded since the last frame.
+	unsigned long bytes,frames,resyncs;
+	struct {
+		unsigned int pos;// Ring position of the first byte of the chunk.
+		unsigned long long t;
+	} stamps[UPS_RING_STAMPS];
+	unsigned int nstamps;// Free running.
+};
+
+// Discard everything buffered, e.g. after the port was reopened. The counters are kept.
+static inline void ups_ring_reset(struct ups_ring *r){
+	r->head = r->tail = r->scan = 0;
+	r->in_frame = r->skipped = 0;
+	r->nstamps = 0;
+}
+
+static inline void ups_ring_init(struct ups_ring *r){
+	ups_ring_reset(r);
+	r->bytes = r->frames = r->resyncs = 0;
+}
+
+// Return the size of the contiguous free space at the write position and point *ptr to it.
+static inline unsigned int ups_ring_space(struct ups_ring *r,char **ptr){
+	unsigned int off = r->head&UPS_RING_MASK;
+	unsigned int n = UPS_RING_SIZE-(r->head-r->tail);
+
+	if (n>UPS_RING_SIZE-off) n = UPS_RING_SIZE-off;
+	*ptr = r->buf+off;
+	return n;
+}
+
+// Account for n bytes written into the space returned by ups_ring_space().
+static inline void ups_ring_commit(struct ups_ring *r,unsigned int n){
+	r->head += n;
+	r->bytes += n;
+}
+
+// Record that the bytes committed next arrived at time t, in any unit the caller likes.
+static inline void ups_ring_stamp(struct ups_ring *r,unsigned long long t){
+	r->stamps[r->nstamps&(UPS_RING_STAMPS-1)].pos = r->head;
+	r->stamps[r->nstamps&(UPS_RING_STAMPS-1)].t = t;
+	r->nstamps++;
+}
+
+// Arrival time of the byte at ring position pos, or of the oldest chunk still known if it is older. 0 without any stamp.
+static inline unsigned long long ups_ring_time(const struct ups_ring *r,unsigned int pos){
+	unsigned int i,n = r->nstamps<UPS_RING_STAMPS?r->nstamps:UPS_RING_STAMPS;
+	unsigned int k = 0;
+
+	for (i=1;i<=n;i++) {
+		k = (r->nstamps-i)&(UPS_RING_STAMPS-1);
+		if ((int)(pos-r->stamps[k].pos)>=0) break;
+	}
+	return n?r->stamps[k].t:0;
+}
+
+// Arrival time of the start delimiter of the frame whose payload starts at off.
+static inline unsigned long long ups_ring_frame_time(const struct ups_ring *r,unsigned int off){
+	return ups_ring_time(r,off-2);
+}
+
+static inline char ups_ring_at(const struct ups_ring *r,unsigned int pos){
+	return r->buf[pos&UPS_RING_MASK];
+}
+
+// Drop the frame being collected and restart the search at the current byte.
+// The resync is accounted for when the next frame starts.
+static inline void ups_ring_resync(struct ups_ring *r){
+	r->in_frame = 0;
+	r->skipped = 1;
+	r->tail = r->scan;
+}
+
+// A byte was lost or damaged on the line: drop the frame being collected, including any bytes not scanned yet.
+// Frames completed before it must have been taken with ups_ring_next_frame() first.
+static inline void ups_ring_break(struct ups_ring *r){
+	r->scan = r->head;
+	ups_ring_resync(r);
+}
+
+/*
+ * Locate the next complete frame. On success the payload, without the "$ " and
+ * " $" delimiters, starts at ring position *off and is *len bytes long. It stays
+ * valid until more data is committed to the ring.
+ */
+static inline int ups_ring_next_frame(struct ups_ring *r,unsigned int *off,unsigned int *len){
+	char c;
+
+	while (r->scan!=r->head) {
+		c = ups_ring_at(r,r->scan);
+		if (!r->in_frame) {
+			if (c=='$') {
+				// One more byte is needed to tell a start delimiter from an end one.
+				if (r->scan+1==r->head) return 0;
+				if (ups_ring_at(r,r->scan+1)==' ') {
+					if (r->skipped) r->resyncs++;
+					r->skipped = 0;
+					r->in_frame = 1;
+					r->tail = r->scan;
+					r->scan += 2;
+					continue;
+				}
+			}
+			if (c!='\r'&&c!='\n') r->skipped = 1;
+			r->tail = ++r->scan;
+			continue;
+		}
+		if (c=='$') {
+			if (r->scan-r->tail>=3&&ups_ring_at(r,r->scan-1)==' ') {
+				*off = r->tail+2;
+				*len = r->scan-1-*off;
+				r->tail = ++r->scan;
+				r->in_frame = 0;
+				r->frames++;
+				return 1;
+			}
+			// Start of a new frame before the end of the current one.
+			ups_ring_resync(r);
+			continue;
+		}
+		if (r->scan-r->tail>UPS_FRAME_MAX) {
+			ups_ring_resync(r);
+			continue;
+		}
+		r->scan++;
+	}
+	return 0;
+}
+
+// Fields of a status frame.
+enum ups_field {
+	UPS_FIELD_VERSION = 1,
+	UPS_FIELD_VIN = 2,
+	UPS_FIELD_BATCAP = 4,
+	UPS_FIELD_VOUT = 8,
+	UPS_FIELD_ALL = 15,
+};
+
+// Battery status derived from a frame. Values match POWER_SUPPLY_STATUS_*.
+enum ups_status {
+	UPS_STATUS_UNKNOWN,
+	UPS_STATUS_CHARGING,
+	UPS_STATUS_DISCHARGING,
+	UPS_STATUS_NOT_CHARGING,
+	UPS_STATUS_FULL,
+};
+
+struct ups_frame {
+	char version[UPS_VERSION_MAX];// Firmware version, e.g. "V3.2P".
+	int vin;// External power: 1 for GOOD, 0 for NG.
+	int batcap;// Battery percentage (0-100).
+	int vout;// Output voltage (millivolts).
+};
+
+// Match the literal s at index *i of the frame and advance past it.
+static inline int ups_parse_match(const char *buf,unsigned int mask,unsigned int off,unsigned int len,unsigned int *i,const char *s){
+	unsigned int n;
+
+	for (n=0;s[n];n++)
+		if (*i+n>=len||buf[(off+*i+n)&mask]!=s[n]) return 0;
+	*i += n;
+	return 1;
+}
+
+// Parse a decimal number of at most 6 digits at index *i and advance past it.
+static inline int ups_parse_number(const char *buf,unsigned int mask,unsigned int off,unsigned int len,unsigned int *i,int *val){
+	unsigned int n = 0;
+	char c;
+
+	*val = 0;
+	while (*i<len) {
+		c = buf[(off+*i)&mask];
+		if (c<'0'||c>'9') break;
+		if (++n>6) return -1;
+		*val = *val*10+c-'0';
+		(*i)++;
+	}
+	return n?0:-1;
+}
+
+/*
+ * Parse the frame payload of len bytes starting at off. Every index is reduced
+ * with mask, so the payload may wrap around the end of a ring buffer; pass ~0U
+ * for a linear buffer. The payload is walked once, fields may come in any order
+ * and each must appear exactly once. Returns 0 on success, -1 if the frame is
+ * corrupted.
+ */
+static inline int ups_parse_frame(const char *buf,unsigned int mask,unsigned int off,unsigned int len,struct ups_frame *f){
+	unsigned int i = 0,n;
+	int field,seen = 0;
+	char c;
+
+	while (i<len) {
+		if (ups_parse_match(buf,mask,off,len,&i,"SmartUPS ")) {
+			field = UPS_FIELD_VERSION;
+			for (n=0;i<len&&(c=buf[(off+i)&mask])!=',';i++,n++) {
+				if (n>=UPS_VERSION_MAX-1) return -1;
+				f->version[n] = c;
+			}
+			f->version[n] = '\0';
+		}
+		else if (ups_parse_match(buf,mask,off,len,&i,"Vin ")) {
+			field = UPS_FIELD_VIN;
+			if (ups_parse_match(buf,mask,off,len,&i,"GOOD")) f->vin = 1;
+			else if (ups_parse_match(buf,mask,off,len,&i,"NG")) f->vin = 0;
+			else return -1;
+		}
+		else if (ups_parse_match(buf,mask,off,len,&i,"BATCAP ")) {
+			field = UPS_FIELD_BATCAP;
+			if (ups_parse_number(buf,mask,off,len,&i,&f->batcap)||f->batcap>100) return -1;
+		}
+		else if (ups_parse_match(buf,mask,off,len,&i,"Vout ")) {
+			field = UPS_FIELD_VOUT;
+			if (ups_parse_number(buf,mask,off,len,&i,&f->vout)) return -1;
+		}
+		else return -1;
+		if (seen&field) return -1;
+		seen |= field;
+		// Each field must end exactly at a separator or at the end of the frame.
+		if (i<len&&!ups_parse_match(buf,mask,off,len,&i,",")) return -1;
+	}
+	return seen==UPS_FIELD_ALL?0:-1;
+}
+
+static inline int ups_frame_status(const struct ups_frame *f){
+	if (f->vout<UPS_VOUT_LOW) return UPS_STATUS_NOT_CHARGING;
+	if (f->vin) return f->batcap==100?UPS_STATUS_FULL:UPS_STATUS_CHARGING;
+	return UPS_STATUS_DISCHARGING;
+}
+
+static inline int ups_ring_parse(const struct ups_ring *r,unsigned int off,unsigned int len,struct ups_frame *f){
+	return ups_parse_frame(r->buf,UPS_RING_MASK,off,len,f);
+}
+
+#endif
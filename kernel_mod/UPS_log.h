@@ -0,0 +1,286 @@
+/*
+ * Compact append-only telemetry log.
+ *
+ * The log is a sequence of UPS_LOG_BLOCK byte blocks. Every block starts
+ * with a struct ups_log_header and can be decoded on its own, so a reader
+ * can binary search the blocks by time and decode only the ones it needs.
+ * A record is
+ *   varint  milliseconds since the previous record of the block
+ *   byte    UPS_LOG_* mask of what follows
+ *   varint  unit, only with UPS_LOG_UNIT (unit 0 otherwise)
+ *   byte    status, with UPS_LOG_STATUS
+ *   zigzag varint deltas of percentage, voltage, et_charge, et_discharge, with their bits
+ * UPS_LOG_EXT flips external_online. Every value is relative to the previous
+ * record of the same unit in the block, starting from 0 with external
+ * power off, so a steady sample takes 2 bytes and a voltage change about 4.
+ *
+ * Writes are batched in memory and flushed in whole blocks; the block being
+ * filled is written padded and rewritten in place by the next flush. A
+ * flush happens every interval, when UPS_LOG_BUFFER blocks are full and
+ * whenever the writer asks for one, e.g. on mains loss. A writer that may
+ * stop appending polls ups_log_due() so that records do not wait longer
+ * than the interval.
+ */
+
+#ifndef UPS_LOG_H
+#define UPS_LOG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define UPS_LOG_MAGIC 0x4c535055// "UPSL"
+#define UPS_LOG_VERSION 1
+#define UPS_LOG_BLOCK 4096
+#define UPS_LOG_BUFFER 16// Blocks buffered in memory.
+#define UPS_LOG_UNITS 64// Units beyond these are not logged.
+#define UPS_LOG_RECORD_MAX 40
+
+#define UPS_LOG_STATUS 0x01
+#define UPS_LOG_EXT 0x02
+#define UPS_LOG_PERCENTAGE 0x04
+#define UPS_LOG_VOLTAGE 0x08
+#define UPS_LOG_ET_CHARGE 0x10
+#define UPS_LOG_ET_DISCHARGE 0x20
+#define UPS_LOG_UNIT 0x80
+
+struct ups_log_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t used;// Bytes in use, header included.
+	uint64_t first;// CLOCK_REALTIME of the first record (milliseconds).
+	uint64_t last;// CLOCK_REALTIME of the last record.
+	uint32_t records;
+	uint32_t reserved;
+};
+
+struct ups_log_sample {
+	uint64_t time;// CLOCK_REALTIME (milliseconds).
+	int unit;
+	int status,percentage,voltage,external_online,et_charge,et_discharge;
+};
+
+// Previous record of every unit, as seen by the encoder or a decoder.
+struct ups_log_codec {
+	uint64_t time;
+	struct ups_log_sample prev[UPS_LOG_UNITS];
+};
+
+static inline void ups_log_codec_reset(struct ups_log_codec *c,uint64_t time){
+	int i;
+
+	memset(c,0,sizeof(*c));
+	c->time = time;
+	for (i=0;i<UPS_LOG_UNITS;i++) c->prev[i].unit = i;
+}
+
+static inline int ups_log_put_varint(uint8_t *p,uint64_t v){
+	int n = 0;
+
+	while (v>=0x80) {
+		p[n++] = (uint8_t)v|0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
+
+static inline int ups_log_put_delta(uint8_t *p,int v,int prev){
+	int64_t d = (int64_t)v-prev;
+	return ups_log_put_varint(p,(uint64_t)(d<0?-2*d-1:2*d));
+}
+
+// Encode s into p (at least UPS_LOG_RECORD_MAX bytes). Returns the length.
+static inline int ups_log_encode(struct ups_log_codec *c,uint8_t *p,const struct ups_log_sample *s){
+	struct ups_log_sample *o = &c->prev[s->unit];
+	uint8_t mask = 0;
+	int n;
+
+	if (s->unit) mask |= UPS_LOG_UNIT;
+	if (s->status!=o->status) mask |= UPS_LOG_STATUS;
+	if (!s->external_online!=!o->external_online) mask |= UPS_LOG_EXT;
+	if (s->percentage!=o->percentage) mask |= UPS_LOG_PERCENTAGE;
+	if (s->voltage!=o->voltage) mask |= UPS_LOG_VOLTAGE;
+	if (s->et_charge!=o->et_charge) mask |= UPS_LOG_ET_CHARGE;
+	if (s->et_discharge!=o->et_discharge) mask |= UPS_LOG_ET_DISCHARGE;
+
+	n = ups_log_put_varint(p,s->time>c->time?s->time-c->time:0);
+	p[n++] = mask;
+	if (mask&UPS_LOG_UNIT) n += ups_log_put_varint(p+n,s->unit);
+	if (mask&UPS_LOG_STATUS) p[n++] = (uint8_t)s->status;
+	if (mask&UPS_LOG_PERCENTAGE) n += ups_log_put_delta(p+n,s->percentage,o->percentage);
+	if (mask&UPS_LOG_VOLTAGE) n += ups_log_put_delta(p+n,s->voltage,o->voltage);
+	if (mask&UPS_LOG_ET_CHARGE) n += ups_log_put_delta(p+n,s->et_charge,o->et_charge);
+	if (mask&UPS_LOG_ET_DISCHARGE) n += ups_log_put_delta(p+n,s->et_discharge,o->et_discharge);
+	if (s->time>c->time) c->time = s->time;
+	*o = *s;
+	o->external_online = !!s->external_online;
+	return n;
+}
+
+static inline int ups_log_get_varint(const uint8_t *p,const uint8_t *end,uint64_t *v){
+	int n = 0,shift = 0;
+
+	*v = 0;
+	do {
+		if (p+n>=end||shift>63) return -1;
+		*v |= (uint64_t)(p[n]&0x7f)<<shift;
+		shift += 7;
+	} while (p[n++]&0x80);
+	return n;
+}
+
+static inline int ups_log_get_delta(const uint8_t *p,const uint8_t *end,int *v){
+	uint64_t z;
+	int n = ups_log_get_varint(p,end,&z);
+
+	if (n>0) *v += (int)(z&1?-(int64_t)(z>>1)-1:(int64_t)(z>>1));
+	return n;
+}
+
+// Validate block b. Returns the end of its records, or NULL if it is not a log block.
+static inline const uint8_t *ups_log_block_end(const uint8_t *b){
+	const struct ups_log_header *h = (const struct ups_log_header *)b;
+
+	if (h->magic!=UPS_LOG_MAGIC||h->version!=UPS_LOG_VERSION||h->used<sizeof(*h)||h->used>UPS_LOG_BLOCK) return NULL;
+	return b+h->used;
+}
+
+// Decode the record at *p into s and advance *p. Returns -1 on a corrupted record.
+static inline int ups_log_decode(struct ups_log_codec *c,const uint8_t **p,const uint8_t *end,struct ups_log_sample *s){
+	const uint8_t *q = *p;
+	uint64_t v;
+	uint8_t mask;
+	int n;
+
+	if ((n = ups_log_get_varint(q,end,&v))<0||q+n>=end) return -1;
+	q += n;
+	c->time += v;
+	mask = *q++;
+	v = 0;
+	if ((mask&UPS_LOG_UNIT)&&((n = ups_log_get_varint(q,end,&v))<0||v>=UPS_LOG_UNITS)) return -1;
+	if (mask&UPS_LOG_UNIT) q += n;
+	*s = c->prev[v];
+	s->time = c->time;
+	if (mask&UPS_LOG_STATUS) {
+		if (q>=end) return -1;
+		s->status = *q++;
+	}
+	if (mask&UPS_LOG_EXT) s->external_online = !s->external_online;
+	if ((mask&UPS_LOG_PERCENTAGE)&&(n = ups_log_get_delta(q,end,&s->percentage))<0) return -1;
+	if (mask&UPS_LOG_PERCENTAGE) q += n;
+	if ((mask&UPS_LOG_VOLTAGE)&&(n = ups_log_get_delta(q,end,&s->voltage))<0) return -1;
+	if (mask&UPS_LOG_VOLTAGE) q += n;
+	if ((mask&UPS_LOG_ET_CHARGE)&&(n = ups_log_get_delta(q,end,&s->et_charge))<0) return -1;
+	if (mask&UPS_LOG_ET_CHARGE) q += n;
+	if ((mask&UPS_LOG_ET_DISCHARGE)&&(n = ups_log_get_delta(q,end,&s->et_discharge))<0) return -1;
+	if (mask&UPS_LOG_ET_DISCHARGE) q += n;
+	c->prev[v] = *s;
+	*p = q;
+	return 0;
+}
+
+struct ups_log {
+	int fd;
+	uint64_t interval;// Flush interval (milliseconds).
+	uint64_t flushed;// Time of the last flush.
+	int pending;// Records appended since.
+	off_t base;// File offset of the first buffered block.
+	int cur;// Block being filled.
+	uint8_t *buf;// UPS_LOG_BUFFER blocks.
+	struct ups_log_codec codec;
+	unsigned long flushes;
+	uint64_t written;// Bytes written to the file.
+};
+
+// Open the log for appending. Anything after the last whole block is overwritten. Returns -1 on failure.
+static inline int ups_log_open(struct ups_log *l,const char *path,uint64_t interval){
+	off_t size;
+
+	memset(l,0,sizeof(*l));
+	l->interval = interval;
+	if (posix_memalign((void **)&l->buf,UPS_LOG_BLOCK,UPS_LOG_BUFFER*UPS_LOG_BLOCK)) return -1;
+	memset(l->buf,0,UPS_LOG_BUFFER*UPS_LOG_BLOCK);
+	l->fd = open(path,O_WRONLY|O_CREAT|O_CLOEXEC,0644);
+	if (l->fd<0||(size = lseek(l->fd,0,SEEK_END))<0) {
+		if (l->fd>=0) close(l->fd);
+		free(l->buf);
+		return -1;
+	}
+	l->base = size/UPS_LOG_BLOCK*UPS_LOG_BLOCK;
+	return 0;
+}
+
+// Write every buffered block, the one being filled padded, and start over with the latter.
+static inline int ups_log_flush(struct ups_log *l,uint64_t now){
+	size_t len = (size_t)(l->cur+1)*UPS_LOG_BLOCK;
+	uint8_t *cur = l->buf+(size_t)l->cur*UPS_LOG_BLOCK;
+	int ret = 0;
+
+	l->flushed = now;
+	if (!l->pending) return 0;
+	l->pending = 0;
+	if (pwrite(l->fd,l->buf,len,l->base)!=(ssize_t)len||fdatasync(l->fd)) ret = -1;
+	l->flushes++;
+	l->written += len;
+	if (l->cur) {
+		memcpy(l->buf,cur,UPS_LOG_BLOCK);
+		memset(l->buf+UPS_LOG_BLOCK,0,(size_t)l->cur*UPS_LOG_BLOCK);
+		l->base += (off_t)l->cur*UPS_LOG_BLOCK;
+		l->cur = 0;
+	}
+	return ret;
+}
+
+// Append s. Flushes when the interval has passed or the buffer is full. Returns -1 if a flush failed.
+static inline int ups_log_append(struct ups_log *l,const struct ups_log_sample *s){
+	struct ups_log_header *h = (struct ups_log_header *)(l->buf+(size_t)l->cur*UPS_LOG_BLOCK);
+	uint8_t rec[UPS_LOG_RECORD_MAX];
+	struct ups_log_codec saved;
+	int len,ret = 0;
+
+	if (s->unit<0||s->unit>=UPS_LOG_UNITS) return 0;
+	if (!l->flushed) l->flushed = s->time;
+	if (h->magic) {
+		saved = l->codec;
+		len = ups_log_encode(&l->codec,rec,s);
+		if (h->used+len<=UPS_LOG_BLOCK) goto put;
+		// The block is full: start the next one, flushing first if it is the last buffered one.
+		l->codec = saved;
+		if (l->cur==UPS_LOG_BUFFER-1&&ups_log_flush(l,s->time)) ret = -1;
+		l->cur++;
+		h = (struct ups_log_header *)(l->buf+(size_t)l->cur*UPS_LOG_BLOCK);
+		memset(h,0,UPS_LOG_BLOCK);
+	}
+	h->magic = UPS_LOG_MAGIC;
+	h->version = UPS_LOG_VERSION;
+	h->used = sizeof(*h);
+	h->first = s->time;
+	ups_log_codec_reset(&l->codec,s->time);
+	len = ups_log_encode(&l->codec,rec,s);
+put:
+	memcpy((uint8_t *)h+h->used,rec,len);
+	h->used += len;
+	h->last = s->time;
+	h->records++;
+	l->pending++;
+	if (s->time-l->flushed>=l->interval&&ups_log_flush(l,s->time)) ret = -1;
+	return ret;
+}
+
+// Milliseconds until the pending records are due to be flushed, 0 if they are, -1 if there are none.
+static inline int ups_log_due(const struct ups_log *l,uint64_t now){
+	if (!l->pending) return -1;
+	if (now-l->flushed>=l->interval) return 0;
+	return (int)(l->flushed+l->interval-now);
+}
+
+static inline void ups_log_close(struct ups_log *l,uint64_t now){
+	ups_log_flush(l,now);
+	close(l->fd);
+	free(l->buf);
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Self-monitoring metrics for UPS_comm in the Prometheus text format.
+ *
+ * Metrics are written by the serial reader and publisher threads with relaxed
+ * atomics on preallocated storage, so recording a value never locks or
+ * allocates. The exporter runs on its own thread and
+ * serves a plain HTTP/1.0 response to every connection on 127.0.0.1
+ * (UPS_METRICS_PORT) or, when the UPS_METRICS environment variable is set, on
+ * the TCP port or absolute Unix socket path it names. UPS_METRICS=off
+ * disables the exporter.
+ */
+
+#ifndef UPS_METRICS_H
+#define UPS_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define UPS_METRICS_PORT 9751
+#define UPS_EXPORTER_TIMEOUT 2// Seconds a scrape may take to send its request and read the reply.
+#define UPS_EXPORTER_STACK (64*1024)
+#define UPS_HIST_BUCKETS 24// Upper bounds of 2^i microseconds, 1us to about 8s, plus +Inf.
+
+// Histogram of durations. Bucket counts are not cumulative; the exporter sums them.
+struct ups_hist {
+	uint64_t bucket[UPS_HIST_BUCKETS+1];
+	uint64_t sum_ns;
+};
+
+struct ups_metrics {
+	// Serial reader.
+	uint64_t bytes,frames,corrupted,read_errors,resyncs,queue_drops,skipped,reconnects;
+	int32_t ports_up;
+	struct ups_hist interarrival,jitter,recovery;
+	// Publisher.
+	uint64_t published,sysfs_failures;
+	// Both threads.
+	uint64_t wakeups,log_drops;
+	int32_t status,percentage,voltage,external_online,et_charge,et_discharge,subscribers;
+	struct ups_hist latency;// Frame parsed to sample published.
+};
+
+static inline void ups_metric_add(uint64_t *c,uint64_t n){
+	__atomic_fetch_add(c,n,__ATOMIC_RELAXED);
+}
+
+static inline void ups_metric_set(int32_t *g,int32_t v){
+	__atomic_store_n(g,v,__ATOMIC_RELAXED);
+}
+
+static inline void ups_hist_observe(struct ups_hist *h,uint64_t ns){
+	// Rounded up, so that ns<=2^i microseconds exactly when us<=2^i.
+	uint64_t us = (ns+999)/1000;
+	int i = us?64-__builtin_clzll(us):0;
+
+	// Smallest i with us<=2^i.
+	if (us&&!(us&(us-1))) i--;
+	if (i>UPS_HIST_BUCKETS) i = UPS_HIST_BUCKETS;
+	__atomic_fetch_add(&h->bucket[i],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_ns,ns,__ATOMIC_RELAXED);
+}
+
+static inline int ups_metrics_counter(char *buf,int size,const char *name,const char *help,uint64_t *c){
+	return snprintf(buf,size,"# HELP %s %s\n# TYPE %s counter\n%s %llu\n",name,help,name,name,
+		(unsigned long long)__atomic_load_n(c,__ATOMIC_RELAXED));
+}
+
+static inline int ups_metrics_gauge(char *buf,int size,const char *name,const char *help,int32_t *g){
+	return snprintf(buf,size,"# HELP %s %s\n# TYPE %s gauge\n%s %d\n",name,help,name,name,
+		__atomic_load_n(g,__ATOMIC_RELAXED));
+}
+
+static inline int ups_metrics_hist(char *buf,int size,const char *name,const char *help,struct ups_hist *h){
+	uint64_t total = 0;
+	int i,len;
+
+	len = snprintf(buf,size,"# HELP %s %s\n# TYPE %s histogram\n",name,help,name);
+	for (i=0;i<=UPS_HIST_BUCKETS&&len<size;i++) {
+		total += __atomic_load_n(&h->bucket[i],__ATOMIC_RELAXED);
+		if (i<UPS_HIST_BUCKETS) len += snprintf(buf+len,size-len,"%s_bucket{le=\"%.9g\"} %llu\n",name,(1ULL<<i)/1e6,(unsigned long long)total);
+		else len += snprintf(buf+len,size-len,"%s_bucket{le=\"+Inf\"} %llu\n",name,(unsigned long long)total);
+	}
+	if (len<size) len += snprintf(buf+len,size-len,"%s_sum %.6f\n%s_count %llu\n",name,
+		__atomic_load_n(&h->sum_ns,__ATOMIC_RELAXED)/1e9,name,(unsigned long long)total);
+	return len;
+}
+
+// Format all metrics into buf. Returns the length, truncated to size-1.
+static inline int ups_metrics_format(struct ups_metrics *m,char *buf,int size){
+	int len = 0;
+
+#define UPS_METRICS_PUT(f,...) if (len<size) len += f(buf+len,size-len,__VA_ARGS__)
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_serial_bytes_total","Bytes read from the serial port.",&m->bytes);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_frames_total","Frames parsed successfully.",&m->frames);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_frames_corrupted_total","Frames rejected by the parser.",&m->corrupted);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_serial_read_errors_total","Failed reads from the serial port.",&m->read_errors);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_serial_resyncs_total","Times the reader had to skip bytes to find a frame.",&m->resyncs);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_queue_drops_total","Samples dropped because the publisher fell behind.",&m->queue_drops);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_frames_skipped_total","Steady frames not processed in low-power mode.",&m->skipped);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_serial_reconnects_total","Times a failed serial port was reopened.",&m->reconnects);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_samples_published_total","Samples handled by the publisher.",&m->published);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_sysfs_write_failures_total","Failed writes to the module state parameter.",&m->sysfs_failures);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_wakeups_total","Times the reader or publisher thread woke up.",&m->wakeups);
+	UPS_METRICS_PUT(ups_metrics_counter,"ups_log_messages_dropped_total","Log messages lost because stderr was not writable.",&m->log_drops);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_battery_status","POWER_SUPPLY_STATUS_* value of the battery.",&m->status);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_battery_percentage","Battery capacity in percent.",&m->percentage);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_output_voltage_millivolts","Output voltage.",&m->voltage);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_external_online","1 when external power is present.",&m->external_online);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_time_to_full_seconds","Estimated time to full, -1 if unknown.",&m->et_charge);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_time_to_empty_seconds","Estimated time to empty, -1 if unknown.",&m->et_discharge);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_subscribers","Connected socket subscribers.",&m->subscribers);
+	UPS_METRICS_PUT(ups_metrics_gauge,"ups_serial_ports_up","Serial ports currently open.",&m->ports_up);
+	UPS_METRICS_PUT(ups_metrics_hist,"ups_frame_interarrival_seconds","Time between the first bytes of consecutive frames.",&m->interarrival);
+	UPS_METRICS_PUT(ups_metrics_hist,"ups_frame_jitter_seconds","Change of the time between frames from one frame to the next.",&m->jitter);
+	UPS_METRICS_PUT(ups_metrics_hist,"ups_serial_recovery_seconds","Time from closing a failed serial port to its next valid frame.",&m->recovery);
+	UPS_METRICS_PUT(ups_metrics_hist,"ups_publish_latency_seconds","Time from parsing a frame to publishing its sample.",&m->latency);
+#undef UPS_METRICS_PUT
+	return len<size?len:size-1;
+}
+
+struct ups_exporter {
+	int fd;
+	struct ups_metrics *m;
+	pthread_t thread;
+};
+
+static inline void *ups_exporter_run(void *arg){
+	struct ups_exporter *x = arg;
+	static char body[16384];
+	struct timeval timeout = {UPS_EXPORTER_TIMEOUT,0};
+	char head[128],req[512];
+	int fd,len,hlen;
+
+	while (1) {
+		fd = accept(x->fd,NULL,NULL);
+		if (fd<0) {
+			if (errno==EINTR||errno==ECONNABORTED) continue;
+			break;
+		}
+		// A client that stalls must not hold up the next scrape, as connections are served one at a time.
+		setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+		// Any request gets the metrics; the request itself is not parsed.
+		recv(fd,req,sizeof(req),0);
+		len = ups_metrics_format(x->m,body,sizeof(body));
+		hlen = snprintf(head,sizeof(head),"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",len);
+		if (send(fd,head,hlen,MSG_NOSIGNAL)==hlen) send(fd,body,len,MSG_NOSIGNAL);
+		close(fd);
+	}
+	return NULL;
+}
+
+// Start the exporter thread. Failing to start it only prints a warning.
+static inline void ups_exporter_start(struct ups_exporter *x,struct ups_metrics *m){
+	const char *where = getenv("UPS_METRICS");
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	pthread_attr_t attr;
+	int one = 1;
+
+	x->fd = -1;
+	x->m = m;
+	if (where&&(!*where||!strcmp(where,"off"))) return;
+	if (where&&where[0]=='/') {
+		if (strlen(where)>=sizeof(un.sun_path)) return;
+		memset(&un,0,sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path,where);
+		unlink(where);
+		x->fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if (x->fd>=0&&bind(x->fd,(struct sockaddr *)&un,sizeof(un))) goto failed;
+	}
+	else {
+		memset(&in,0,sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(where?atoi(where):UPS_METRICS_PORT);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		x->fd = socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if (x->fd>=0) setsockopt(x->fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+		if (x->fd>=0&&bind(x->fd,(struct sockaddr *)&in,sizeof(in))) goto failed;
+	}
+	// A small stack, as it is locked along with everything else in real-time mode.
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr,UPS_EXPORTER_STACK);
+	if (x->fd<0||listen(x->fd,16)||pthread_create(&x->thread,&attr,ups_exporter_run,x)) {
+		pthread_attr_destroy(&attr);
+		goto failed;
+	}
+	pthread_attr_destroy(&attr);
+	pthread_detach(x->thread);
+	return;
+failed:
+	fprintf(stderr,"UPS: Warning: Error %d starting metrics exporter: %s\n",errno,strerror(errno));
+	if (x->fd>=0) close(x->fd);
+	x->fd = -1;
+}
+
+#endif
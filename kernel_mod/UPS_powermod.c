@@ -19,12 +19,36 @@
 #include <linux/power_supply.h>
 #include <linux/errno.h>
 #include <linux/delay.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/tty.h>
+#include <linux/tty_ldisc.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/timekeeping.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include "UPS_frame.h"
+#include "UPS_estimate.h"
+#include "UPS_record.h"
+#include "UPS_schema.h"
+#define CREATE_TRACE_POINTS
+#include "UPS_trace.h"
 //#include <linux/vermagic.h>
 
 // Values below are static as non of the following attributes are supported.
 #define BAT_TEMPERATURE 260
-#define BAT_HEALTH POWER_SUPPLY_HEALTH_GOOD;
-#define BAT_TECH POWER_SUPPLY_TECHNOLOGY_LION;
+#define BAT_HEALTH POWER_SUPPLY_HEALTH_GOOD
+#define BAT_TECH POWER_SUPPLY_TECHNOLOGY_LION
 
 enum ups_powersource_id {
 	EXTERNAL,
@@ -32,23 +56,217 @@ enum ups_powersource_id {
 	POWERSOURCE_COUNT,
 };
 
-static int external_online = 1;
-static int battery_status = POWER_SUPPLY_STATUS_UNKNOWN;
-static int battery_percentage = 50;
-static int output_voltage = 5250;
-static int battery_present = 0; /* false */
-static int battery_energy = 3700000;// Default to 10000mAh@3.7V Allowed to be changed via exposed interface.
-static int et_charge = -1;
-static int et_discharge = -1;
+struct ups_battery_state {
+	UPS_FIELDS(UPS_FIELD_DECLARE,)// See UPS_schema.h.
+	int stale;// Restored from a snapshot and not confirmed by the UPS yet.
+	u64 seq;// Incremented on every update.
+	u64 timestamp;// ktime_get_ns() of the last update.
+	u64 sampled;// CLOCK_MONOTONIC time the first byte of the sample was read, 0 if unknown.
+};
+
+#define UPS_MAX_UNITS 8
+#define UPS_MAX_HISTORY 65536U// Samples per unit, 1.5 MiB.
+
+/*
+ * One UPSPack. Unit 0 registers "external"/"battery", /dev/ups and debugfs
+ * history; unit n registers "external<n>"/"battery<n>", /dev/ups<n> and
+ * history<n>. Units are set up at load time, see the units parameter.
+ */
+struct ups_unit {
+	int id;
+	char name[POWERSOURCE_COUNT][16];
+	char *supplied_to[1];
+	struct power_supply_desc desc[POWERSOURCE_COUNT];
+	struct power_supply_config config[POWERSOURCE_COUNT];
+	struct power_supply *supplies[POWERSOURCE_COUNT];
+
+	// Battery state. Written by the parameter setters under the seqlock so that property reads are lock-free and always see one consistent update.
+	struct ups_battery_state state;
+	seqlock_t lock;
+	wait_queue_head_t wait;
+
+	// History of timestamped samples. Appended to under the state write lock; the oldest sample is dropped when full.
+	DECLARE_KFIFO_PTR(history, struct ups_sample);
+
+	struct ups_battery_state notified;// State reported by the last notification.
+	unsigned long notified_at;// jiffies
+	spinlock_t notify_lock;
+	struct delayed_work notify_dwork;
+
+	char dev_name[8];
+	struct miscdevice dev;
+	bool dev_registered;
+	bool ldisc_attached;
+};
+
+static unsigned int units = 1;
+
+/*
+ * The locks are initialised statically rather than in ups_unit_init(), as the
+ * parameters can be written before it runs: on the insmod command line, or
+ * through sysfs while the module is still loading.
+ */
+#define UPS_UNIT_INIT(n) [n] = { \
+	.state = { \
+		.external_online = 1, \
+		.battery_status = POWER_SUPPLY_STATUS_UNKNOWN, \
+		.battery_percentage = 50, \
+		.output_voltage = 5250, \
+		.battery_present = 0, /* false */ \
+		.battery_energy = 3700000,/* Default to 10000mAh@3.7V Allowed to be changed via exposed interface. */ \
+		.et_charge = -1, \
+		.et_discharge = -1, \
+	}, \
+	.lock = __SEQLOCK_UNLOCKED(ups_units[n].lock), \
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(ups_units[n].wait), \
+	.notify_lock = __SPIN_LOCK_UNLOCKED(ups_units[n].notify_lock), \
+}
+
+#if UPS_MAX_UNITS != 8
+#error "ups_units[] needs one UPS_UNIT_INIT() per unit"
+#endif
+static struct ups_unit ups_units[UPS_MAX_UNITS] = {
+	UPS_UNIT_INIT(0), UPS_UNIT_INIT(1), UPS_UNIT_INIT(2), UPS_UNIT_INIT(3),
+	UPS_UNIT_INIT(4), UPS_UNIT_INIT(5), UPS_UNIT_INIT(6), UPS_UNIT_INIT(7),
+};
+
+static unsigned int history_size = 1024;
+static struct dentry *ups_debugfs;
 
 
 static bool module_initialized;
 
+/*
+ * Event counters, kept per CPU so that counting never bounces a cache line,
+ * and summed when debugfs UPS_powermod/stats or a counter parameter is read.
+ */
+struct ups_stats {
+	u64 state_updates;
+	u64 param_writes;
+	u64 param_rejects;
+	u64 notify_sent;
+	u64 notify_deferred;
+	u64 notify_suppressed;
+	u64 ldisc_frames;
+	u64 ldisc_corrupted;
+	u64 ldisc_errors;
+};
+
+static DEFINE_PER_CPU(struct ups_stats, ups_stats);
+
+#define ups_stat_inc(field) this_cpu_inc(ups_stats.field)
+
+#define ups_stat_sum(field) ({ \
+	u64 __sum = 0; \
+	int __cpu; \
+\
+	for_each_possible_cpu(__cpu) \
+		__sum += per_cpu(ups_stats.field, __cpu); \
+	__sum; \
+})
+
+static int ups_stats_show(struct seq_file *m,void *v){
+	struct ups_stats sum = {};
+	const struct ups_stats *st;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&ups_stats, cpu);
+		sum.state_updates += st->state_updates;
+		sum.param_writes += st->param_writes;
+		sum.param_rejects += st->param_rejects;
+		sum.notify_sent += st->notify_sent;
+		sum.notify_deferred += st->notify_deferred;
+		sum.notify_suppressed += st->notify_suppressed;
+		sum.ldisc_frames += st->ldisc_frames;
+		sum.ldisc_corrupted += st->ldisc_corrupted;
+		sum.ldisc_errors += st->ldisc_errors;
+	}
+	seq_printf(m, "state_updates %llu\n", sum.state_updates);
+	seq_printf(m, "param_writes %llu\n", sum.param_writes);
+	seq_printf(m, "param_rejects %llu\n", sum.param_rejects);
+	seq_printf(m, "notify_sent %llu\n", sum.notify_sent);
+	seq_printf(m, "notify_deferred %llu\n", sum.notify_deferred);
+	seq_printf(m, "notify_suppressed %llu\n", sum.notify_suppressed);
+	seq_printf(m, "ldisc_frames %llu\n", sum.ldisc_frames);
+	seq_printf(m, "ldisc_corrupted %llu\n", sum.ldisc_corrupted);
+	seq_printf(m, "ldisc_errors %llu\n", sum.ldisc_errors);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ups_stats);
+
+static void ups_get_state(struct ups_unit *u,struct ups_battery_state *st){
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&u->lock);
+		*st = u->state;
+	} while (read_seqretry(&u->lock, seq));
+}
+
+// End a state update started with write_seqlock(): stamp it and wake up readers of /dev/ups.
+static void ups_state_unlock(struct ups_unit *u){
+	struct ups_battery_state *st = &u->state;
+	struct ups_sample sample;
+
+	st->seq++;
+	st->timestamp = ktime_get_ns();
+	ups_stat_inc(state_updates);
+	trace_ups_state_update(u->id, st->seq, st->battery_status, st->battery_percentage, st->output_voltage,
+		st->external_online, st->et_charge, st->et_discharge);
+	if (kfifo_initialized(&u->history)) {
+		sample.timestamp = st->sampled?st->sampled:st->timestamp;
+		sample.battery_status = st->battery_status;
+		sample.battery_percentage = st->battery_percentage;
+		sample.output_voltage = st->output_voltage;
+		sample.external_online = st->external_online;
+		if (kfifo_is_full(&u->history))
+			kfifo_skip(&u->history);
+		kfifo_put(&u->history, sample);
+	}
+	write_sequnlock(&u->lock);
+	wake_up_interruptible(&u->wait);
+}
+
+/*
+ * Exported power_supply properties: P(property,member,value) is listed and
+ * read as val->member = value, A() is an alias that is answered but not
+ * listed. Battery values are evaluated on a consistent copy st of the unit
+ * state.
+ */
+#define UPS_EXTERNAL_PROPS(P,A) \
+	P(ONLINE, intval, READ_ONCE(u->state.external_online))
+
+#define UPS_BATTERY_PROPS(P,A) \
+	P(STATUS, intval, st.battery_status) \
+	P(CHARGE_TYPE, intval, POWER_SUPPLY_CHARGE_TYPE_FAST) \
+	P(HEALTH, intval, BAT_HEALTH) \
+	P(PRESENT, intval, st.battery_present) \
+	P(TECHNOLOGY, intval, BAT_TECH) \
+	P(CHARGE_FULL_DESIGN, intval, st.battery_energy) \
+	P(CHARGE_FULL, intval, st.battery_energy) \
+	P(CHARGE_NOW, intval, st.battery_percentage*st.battery_energy/100) \
+	P(CAPACITY, intval, st.battery_percentage) \
+	P(CAPACITY_LEVEL, intval, st.stale?POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN:POWER_SUPPLY_CAPACITY_LEVEL_NORMAL) \
+	P(TIME_TO_EMPTY_AVG, intval, st.et_discharge) \
+	A(TIME_TO_EMPTY_NOW, intval, st.et_discharge) \
+	P(TIME_TO_FULL_NOW, intval, st.et_charge) \
+	A(TIME_TO_FULL_AVG, intval, st.et_charge) \
+	P(MODEL_NAME, strval, "RPi UPSPack Standard V3") \
+	P(MANUFACTURER, strval, "MakerFocus") \
+	P(SERIAL_NUMBER, strval, "0") \
+	P(TEMP, intval, BAT_TEMPERATURE) \
+	P(VOLTAGE_NOW, intval, st.output_voltage)
+
+#define UPS_PROP_LIST(prop,member,value) POWER_SUPPLY_PROP_##prop,
+#define UPS_PROP_SKIP(prop,member,value)
+#define UPS_PROP_CASE(prop,member,value) case POWER_SUPPLY_PROP_##prop: val->member = value; break;
+
 static int ups_get_external_property(struct power_supply *psy,enum power_supply_property psp,union power_supply_propval *val){
+	struct ups_unit *u = power_supply_get_drvdata(psy);
+
 	switch (psp) {
-		case POWER_SUPPLY_PROP_ONLINE:
-			val->intval = external_online;
-			break;
+		UPS_EXTERNAL_PROPS(UPS_PROP_CASE, UPS_PROP_CASE)
 		default:
 			return -EINVAL;
 	}
@@ -56,58 +274,12 @@ static int ups_get_external_property(struct power_supply *psy,enum power_supply_
 }
 
 static int ups_get_battery_property(struct power_supply *psy,enum power_supply_property psp,union power_supply_propval *val){
+	struct ups_unit *u = power_supply_get_drvdata(psy);
+	struct ups_battery_state st;
+
+	ups_get_state(u, &st);
 	switch (psp) {
-		case POWER_SUPPLY_PROP_MODEL_NAME:
-			val->strval = "RPi UPSPack Standard V3";
-			break;
-		case POWER_SUPPLY_PROP_MANUFACTURER:
-			val->strval = "MakerFocus";
-			break;
-		case POWER_SUPPLY_PROP_SERIAL_NUMBER:
-			val->strval = "0";
-			break;
-		case POWER_SUPPLY_PROP_PRESENT:
-			val->intval = battery_present;
-			break;
-		case POWER_SUPPLY_PROP_STATUS:
-			val->intval = battery_status;
-			break;
-		case POWER_SUPPLY_PROP_CAPACITY:
-			val->intval = battery_percentage;
-			break;
-		case POWER_SUPPLY_PROP_CHARGE_NOW:
-			val->intval = battery_percentage*battery_energy/100;
-			break;
-		case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
-		case POWER_SUPPLY_PROP_CHARGE_FULL:
-			val->intval = battery_energy;
-			break;
-		case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-			val->intval = output_voltage;
-			break;
-		case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
-		case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
-			val->intval = et_discharge;
-			break;
-		case POWER_SUPPLY_PROP_TIME_TO_FULL_AVG:
-		case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
-			val->intval = et_charge;
-			break;
-		case POWER_SUPPLY_PROP_CHARGE_TYPE:
-			val->intval = POWER_SUPPLY_CHARGE_TYPE_FAST;
-			break;
-		case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
-			break;
-		case POWER_SUPPLY_PROP_TECHNOLOGY:
-			val->intval = BAT_TECH;
-			break;
-		case POWER_SUPPLY_PROP_HEALTH:
-			val->intval = BAT_HEALTH;
-			break;
-		case POWER_SUPPLY_PROP_TEMP:
-			val->intval = BAT_TEMPERATURE;
-			break;
+		UPS_BATTERY_PROPS(UPS_PROP_CASE, UPS_PROP_CASE)
 		default:
 			printk(KERN_WARNING "UPS: %s: Power supply property %d unavailable.\n",__func__,psp);
 			return -EINVAL;
@@ -116,35 +288,14 @@ static int ups_get_battery_property(struct power_supply *psy,enum power_supply_p
 }
 
 static enum power_supply_property ups_external_props[] = {
-	POWER_SUPPLY_PROP_ONLINE,
+	UPS_EXTERNAL_PROPS(UPS_PROP_LIST, UPS_PROP_SKIP)
 };
 
 static enum power_supply_property ups_battery_props[] = {
-	POWER_SUPPLY_PROP_STATUS,
-	POWER_SUPPLY_PROP_CHARGE_TYPE,
-	POWER_SUPPLY_PROP_HEALTH,
-	POWER_SUPPLY_PROP_PRESENT,
-	POWER_SUPPLY_PROP_TECHNOLOGY,
-	POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
-	POWER_SUPPLY_PROP_CHARGE_FULL,
-	POWER_SUPPLY_PROP_CHARGE_NOW,
-	POWER_SUPPLY_PROP_CAPACITY,
-	POWER_SUPPLY_PROP_CAPACITY_LEVEL,
-	POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG,
-	POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
-	POWER_SUPPLY_PROP_MODEL_NAME,
-	POWER_SUPPLY_PROP_MANUFACTURER,
-	POWER_SUPPLY_PROP_SERIAL_NUMBER,
-	POWER_SUPPLY_PROP_TEMP,
-	POWER_SUPPLY_PROP_VOLTAGE_NOW,
-};
-
-static char *ups_external_supplied_to[] = {
-	"battery",
+	UPS_BATTERY_PROPS(UPS_PROP_LIST, UPS_PROP_SKIP)
 };
 
-static struct power_supply *ups_supplies[POWERSOURCE_COUNT];
-
+// Template descriptors; every unit gets a copy with its own names.
 static const struct power_supply_desc ups_desc[] = {
 	[EXTERNAL] = {
 		.name = "external",
@@ -162,332 +313,737 @@ static const struct power_supply_desc ups_desc[] = {
 	}
 };
 
-static const struct power_supply_config ups_configs[] = {
-	{
-		/* external */
-		.supplied_to = ups_external_supplied_to,
-		.num_supplicants = ARRAY_SIZE(ups_external_supplied_to),
-	},
-	{
-		/* battery */
-	}
-};
+/*
+ * Change notifications are coalesced. Status, presence, design capacity and
+ * external power transitions are delivered at once. Percentage and voltage
+ * changes only count once they exceed the configured step and are delivered
+ * through delayed work no sooner than notify_interval after the previous
+ * notification. Anything else updates the state silently.
+ */
+static unsigned int notify_interval = 2000;// ms
+static unsigned int notify_capacity_step = 1;// %
+static unsigned int notify_voltage_delta = 100;// mV
+
+static void ups_notify_locked(struct ups_unit *u){
+	ups_get_state(u, &u->notified);
+	u->notified_at = jiffies;
+	ups_stat_inc(notify_sent);
+	trace_ups_notify(u->id, u->notified.seq, UPS_NOTIFY_SENT);
+	power_supply_changed(u->supplies[BATTERY]);
+}
 
-// Module initialization. Test and start serial communication with UPS module.
+static void ups_notify_suppressed(struct ups_unit *u,u64 seq){
+	ups_stat_inc(notify_suppressed);
+	trace_ups_notify(u->id, seq, UPS_NOTIFY_SUPPRESSED);
+}
 
-static int __init ups_init(void){
-	int i;
-	int ret;
+static void ups_notify_work(struct work_struct *work){
+	struct ups_unit *u = container_of(to_delayed_work(work), struct ups_unit, notify_dwork);
 
-	BUILD_BUG_ON(POWERSOURCE_COUNT != ARRAY_SIZE(ups_supplies));
-	BUILD_BUG_ON(POWERSOURCE_COUNT != ARRAY_SIZE(ups_configs));
+	spin_lock(&u->notify_lock);
+	ups_notify_locked(u);
+	spin_unlock(&u->notify_lock);
+}
 
-	for (i = 0; i < ARRAY_SIZE(ups_supplies); i++) {
-		ups_supplies[i] = power_supply_register(NULL,&ups_desc[i],&ups_configs[i]);
-		if (IS_ERR(ups_supplies[i])) {
-			printk(KERN_ERR "UPS: %s: failed to register %s\n", __func__,ups_desc[i].name);
-			ret = PTR_ERR(ups_supplies[i]);
-			goto failed;
+static void signal_power_supply_changed(struct ups_unit *u){
+	struct ups_battery_state st;
+	unsigned long due;
+
+	if (!module_initialized)
+		return;
+
+	ups_get_state(u, &st);
+	spin_lock(&u->notify_lock);
+	if (st.battery_status!=u->notified.battery_status||st.external_online!=u->notified.external_online||st.battery_present!=u->notified.battery_present||st.battery_energy!=u->notified.battery_energy||st.stale!=u->notified.stale) {
+		cancel_delayed_work(&u->notify_dwork);
+		ups_notify_locked(u);
+	}
+	else if (abs(st.battery_percentage-u->notified.battery_percentage)>=notify_capacity_step||abs(st.output_voltage-u->notified.output_voltage)>=notify_voltage_delta) {
+		due = u->notified_at+msecs_to_jiffies(notify_interval);
+		if (delayed_work_pending(&u->notify_dwork))
+			ups_notify_suppressed(u, st.seq);
+		else if (time_after_eq(jiffies, due))
+			ups_notify_locked(u);
+		else {
+			schedule_delayed_work(&u->notify_dwork, due-jiffies);
+			ups_stat_inc(notify_deferred);
+			trace_ups_notify(u->id, st.seq, UPS_NOTIFY_DEFERRED);
 		}
 	}
+	else
+		ups_notify_suppressed(u, st.seq);
+	spin_unlock(&u->notify_lock);
+}
 
-	module_initialized = true;
-	return 0;
-failed:
-	while (--i >= 0)
-		power_supply_unregister(ups_supplies[i]);
-	return ret;
+// Commit the fields of a batched update at once and send a single change notification. stale marks values restored from a snapshot.
+// sampled is the CLOCK_MONOTONIC time the sample was read, 0 if unknown; times in the future are clamped.
+static void ups_update_state(struct ups_unit *u,const struct ups_fields *v,int stale,u64 sampled){
+	u64 now = ktime_get_ns();
+
+	write_seqlock(&u->lock);
+	u->state.stale = stale;
+	u->state.sampled = sampled>now?now:sampled;
+#define UPS_STATE_ASSIGN(c,name,kind,min,max,batched,desc) UPS_IF_##batched(u->state.name = v->name;)
+	UPS_FIELDS(UPS_STATE_ASSIGN,)
+#undef UPS_STATE_ASSIGN
+	ups_state_unlock(u);
+	signal_power_supply_changed(u);
 }
 
+static void ups_set_present(struct ups_unit *u,int present,int status){
+	write_seqlock(&u->lock);
+	u->state.battery_present = present;
+	u->state.battery_status = status;
+	ups_state_unlock(u);
+	signal_power_supply_changed(u);
+}
 
-// Module termination. End serial communication.
+/*
+ * Optional line discipline. When the module is loaded with ldisc=<num>, the UPS
+ * serial port can be attached with `ldattach -s 9600 -8 -n -1 <num> /dev/ttyAMA2`
+ * and frames are parsed in the tty receive path, so no userspace daemon is needed.
+ * Each attached port drives the first unit that has no port attached yet.
+ */
+static int ldisc;
+static DEFINE_MUTEX(ups_ldisc_lock);
 
-static void __exit ups_exit(void){
+struct ups_ldisc_data {
+	struct ups_unit *unit;
+	struct ups_ring ring;
+	struct ups_estimator est;
+};
+
+static int ups_ldisc_open(struct tty_struct *tty){
+	struct ups_ldisc_data *ld;
 	int i;
 
-	/* Let's see how we handle changes... */
-	external_online = 1;
-	battery_status = POWER_SUPPLY_STATUS_UNKNOWN;
-	battery_present = 0;
-	et_charge = -1;
-	et_discharge = -1;
-	for (i = 0; i < ARRAY_SIZE(ups_supplies); i++)
-		power_supply_changed(ups_supplies[i]);
-	printk(KERN_WARNING "UPS: Module unloading. Power parameters reset. Sleep for 1 sec before unregister...\n");
-	ssleep(1);
-
-	for (i = 0; i < ARRAY_SIZE(ups_supplies); i++)
-		power_supply_unregister(ups_supplies[i]);
+	ld = kmalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		return -ENOMEM;
+	mutex_lock(&ups_ldisc_lock);
+	for (i = 0; i < units && ups_units[i].ldisc_attached; i++);
+	if (i == units) {
+		mutex_unlock(&ups_ldisc_lock);
+		kfree(ld);
+		return -EBUSY;
+	}
+	ups_units[i].ldisc_attached = true;
+	mutex_unlock(&ups_ldisc_lock);
+	ld->unit = &ups_units[i];
+	ups_ring_init(&ld->ring);
+	ups_est_init(&ld->est);
+	tty->disc_data = ld;
+	// tty_ldisc_receive_buf() hands receive_buf() at most receive_room bytes. Everything is taken at once, like slip and ppp do.
+	tty->receive_room = 65536;
+	ups_set_present(ld->unit, 1, POWER_SUPPLY_STATUS_UNKNOWN);
+	return 0;
+}
 
-	module_initialized = false;
+static void ups_ldisc_close(struct tty_struct *tty){
+	struct ups_ldisc_data *ld = tty->disc_data;
+
+	printk(KERN_INFO "UPS: Line discipline detached from unit %d after %lu bytes, %lu frames, %lu resyncs.\n",ld->unit->id,ld->ring.bytes,ld->ring.frames,ld->ring.resyncs);
+	tty->disc_data = NULL;
+	ups_set_present(ld->unit, 0, POWER_SUPPLY_STATUS_UNKNOWN);
+	mutex_lock(&ups_ldisc_lock);
+	ld->unit->ldisc_attached = false;
+	mutex_unlock(&ups_ldisc_lock);
+	kfree(ld);
 }
 
+// rx is the CLOCK_MONOTONIC time the first byte of the frame was received.
+static void ups_ldisc_frame(struct ups_ldisc_data *ld,const struct ups_frame *f,u64 rx){
+	struct ups_battery_state st;
+	struct ups_fields v;
+	int status = ups_frame_status(f);
+	int etc,etd;
+
+	// The estimate runs on CLOCK_BOOTTIME like in UPS_comm, so that a suspend counts as time the battery was in use.
+	ups_est_update(&ld->est, div_u64(rx+ktime_to_ns(ktime_sub(ktime_get_boottime(), ktime_get())), NSEC_PER_MSEC), f->batcap, f->vin, &etc, &etd);
+
+	// Only publish samples that change something.
+	ups_get_state(ld->unit, &st);
+	if (!st.stale&&st.battery_status==status&&st.battery_percentage==f->batcap&&st.output_voltage==f->vout&&st.external_online==f->vin&&st.et_charge==etc&&st.et_discharge==etd)
+		return;
+	v.battery_status = status;
+	v.battery_percentage = f->batcap;
+	v.output_voltage = f->vout;
+	v.external_online = f->vin;
+	v.et_charge = etc;
+	v.et_discharge = etd;
+	ups_update_state(ld->unit, &v, 0, rx);
+}
 
-#define MAX_KEYLENGTH 256
-struct battery_property_map {
-	int value;
-	char const *key;
-};
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+static void ups_ldisc_receive_buf(struct tty_struct *tty,const u8 *cp,const u8 *fp,size_t count){
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+static void ups_ldisc_receive_buf(struct tty_struct *tty,const unsigned char *cp,const char *fp,int count){
+#else
+static void ups_ldisc_receive_buf(struct tty_struct *tty,const unsigned char *cp,char *fp,int count){
+#endif
+	struct ups_ldisc_data *ld = tty->disc_data;
+	struct ups_frame frame;
+	unsigned int off,len,n,i;
+	char *ptr;
+
+	while (count>0) {
+		// A byte received with a framing, parity or overrun error is dropped and the frame it fell in is discarded.
+		if (fp&&*fp!=TTY_NORMAL) {
+			ups_stat_inc(ldisc_errors);
+			ups_ring_break(&ld->ring);
+			cp++;
+			fp++;
+			count--;
+			continue;
+		}
+		n = ups_ring_space(&ld->ring, &ptr);
+		if (n>count)
+			n = count;
+		if (fp) {
+			for (i = 1; i < n && fp[i] == TTY_NORMAL; i++);
+			n = i;
+			fp += n;
+		}
+		ups_ring_stamp(&ld->ring, ktime_get_ns());
+		memcpy(ptr, cp, n);
+		ups_ring_commit(&ld->ring, n);
+		cp += n;
+		count -= n;
+		while (ups_ring_next_frame(&ld->ring, &off, &len)) {
+			if (ups_ring_parse(&ld->ring, off, len, &frame)) {
+				ups_stat_inc(ldisc_corrupted);
+				continue;
+			}
+			ups_stat_inc(ldisc_frames);
+			ups_ldisc_frame(ld, &frame, ups_ring_frame_time(&ld->ring, off));
+		}
+	}
+}
 
-//static struct battery_property_map map_external_online[] = {
-//	{ 0,  "false"  },
-//	{ 1,  "true" },
-//	{ -1, NULL  },
-//};
-
-static struct battery_property_map map_status[] = {
-	{ POWER_SUPPLY_STATUS_UNKNOWN,      "unknown"      },
-	{ POWER_SUPPLY_STATUS_CHARGING,     "charging"     },
-	{ POWER_SUPPLY_STATUS_DISCHARGING,  "discharging"  },
-	{ POWER_SUPPLY_STATUS_NOT_CHARGING, "not-charging" },
-	{ POWER_SUPPLY_STATUS_FULL,         "full"         },
-	{ -1,                               NULL           },
+static struct tty_ldisc_ops ups_ldisc_ops = {
+	.owner = THIS_MODULE,
+#ifdef TTY_LDISC_MAGIC
+	.magic = TTY_LDISC_MAGIC,
+#endif
+	.name = "ups",
+	.open = ups_ldisc_open,
+	.close = ups_ldisc_close,
+	.receive_buf = ups_ldisc_receive_buf,
 };
 
-//static struct battery_property_map map_present[] = {
-//	{ 0,  "false" },
-//	{ 1,  "true"  },
-//	{ -1, NULL    },
-//};
-
-static int map_get_value(struct battery_property_map *map,const char *key,int def_val){
-	char buf[MAX_KEYLENGTH];
-	int cr;
-
-	strncpy(buf, key, MAX_KEYLENGTH);
-	buf[MAX_KEYLENGTH-1] = '\0';
-
-	cr = strnlen(buf, MAX_KEYLENGTH) - 1;
-	if (cr < 0)
-		return def_val;
-	if (buf[cr] == '\n')
-		buf[cr] = '\0';
-
-	while (map->key) {
-		if (strncasecmp(map->key, buf, MAX_KEYLENGTH) == 0)
-			return map->value;
-		map++;
-	}
+static int ups_ldisc_register(void){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+	ups_ldisc_ops.num = ldisc;
+	return tty_register_ldisc(&ups_ldisc_ops);
+#else
+	return tty_register_ldisc(ldisc, &ups_ldisc_ops);
+#endif
+}
 
-	return def_val;
+static void ups_ldisc_unregister(void){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,14,0)
+	tty_unregister_ldisc(&ups_ldisc_ops);
+#else
+	tty_unregister_ldisc(ldisc);
+#endif
 }
 
+/*
+ * /dev/ups returns the whole battery state as one struct ups_record per read()
+ * and supports poll(), so clients can wait for the state to change.
+ */
+struct ups_dev_file {
+	struct ups_unit *unit;
+	u64 seq;// Sequence number of the last record returned.
+	bool fresh;// Nothing has been returned yet.
+};
 
-static const char *map_get_key(struct battery_property_map *map,int value,const char *def_key){
-	while (map->key) {
-		if (map->value == value)
-			return map->key;
-		map++;
-	}
+static u64 ups_state_seq(struct ups_unit *u){
+	struct ups_battery_state st;
 
-	return def_key;
+	ups_get_state(u, &st);
+	return st.seq;
 }
 
-static inline void signal_power_supply_changed(struct power_supply *psy){
-	if (module_initialized)
-		power_supply_changed(psy);
+static int ups_dev_open(struct inode *inode,struct file *file){
+	struct ups_dev_file *priv;
+
+	priv = kmalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	// misc_open() leaves the miscdevice in private_data.
+	priv->unit = container_of(file->private_data, struct ups_unit, dev);
+	priv->seq = 0;
+	priv->fresh = true;
+	file->private_data = priv;
+	return nonseekable_open(inode, file);
 }
 
-//static int param_set_external_online(const char *key, const struct kernel_param *kp){
-//	external_online = map_get_value(map_external_online, key, external_online);
-//	signal_power_supply_changed(ups_supplies[EXTERNAL]);
-//	return 0;
-//}
-//
-//static int param_get_external_online(char *buffer, const struct kernel_param *kp){
-//	strcpy(buffer, map_get_key(map_external_online, external_online, "unknown"));
-//	return strlen(buffer);
-//}
+static int ups_dev_release(struct inode *inode,struct file *file){
+	kfree(file->private_data);
+	return 0;
+}
 
-static int param_set_external_online(const char *buffer, const struct kernel_param *kp){
-	int ext;
+static ssize_t ups_dev_read(struct file *file,char __user *buf,size_t count,loff_t *ppos){
+	struct ups_dev_file *priv = file->private_data;
+	struct ups_battery_state st;
+	struct ups_record rec;
+	int ret;
 
-	if (1 != sscanf(buffer, "%d", &ext))
+	if (count<sizeof(rec))
 		return -EINVAL;
 
-	if (ext==0||ext==1)	external_online = ext;
-	else return -EINVAL;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
+	if (!priv->fresh) {
+		if (file->f_flags&O_NONBLOCK) {
+			if (ups_state_seq(priv->unit)==priv->seq)
+				return -EAGAIN;
+		}
+		else {
+			ret = wait_event_interruptible(priv->unit->wait, ups_state_seq(priv->unit)!=priv->seq);
+			if (ret)
+				return ret;
+		}
+	}
+
+	ups_get_state(priv->unit, &st);
+	memset(&rec, 0, sizeof(rec));
+	rec.seq = st.seq;
+	rec.timestamp = st.timestamp;
+	rec.sampled = st.sampled;
+#define UPS_RECORD_FIELD(c,name,kind,min,max,batched,desc) rec.name = st.name;
+	UPS_FIELDS(UPS_RECORD_FIELD,)
+#undef UPS_RECORD_FIELD
+	rec.flags = st.stale?UPS_RECORD_STALE:0;
+	if (copy_to_user(buf, &rec, sizeof(rec)))
+		return -EFAULT;
+	priv->seq = st.seq;
+	priv->fresh = false;
+	return sizeof(rec);
+}
+
+static __poll_t ups_dev_poll(struct file *file,poll_table *wait){
+	struct ups_dev_file *priv = file->private_data;
+
+	poll_wait(file, &priv->unit->wait, wait);
+	if (priv->fresh||ups_state_seq(priv->unit)!=priv->seq)
+		return EPOLLIN|EPOLLRDNORM;
 	return 0;
 }
 
-#define param_get_external_online param_get_int
+static const struct file_operations ups_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = ups_dev_open,
+	.release = ups_dev_release,
+	.read = ups_dev_read,
+	.poll = ups_dev_poll,
+};
+
+
+/*
+ * debugfs UPS_powermod/history. The whole history is copied out when the file
+ * is opened, so it can be read in bulk with a single read().
+ */
+struct ups_history_buf {
+	size_t len;
+	struct ups_sample samples[];
+};
 
-static int param_set_battery_status(const char *key,const struct kernel_param *kp){
-	battery_status = map_get_value(map_status, key, battery_status);
-	signal_power_supply_changed(ups_supplies[BATTERY]);
+static int ups_history_open(struct inode *inode,struct file *file){
+	struct ups_unit *u = inode->i_private;
+	struct ups_history_buf *hb;
+
+	hb = kvmalloc(struct_size(hb, samples, kfifo_size(&u->history)), GFP_KERNEL);
+	if (!hb)
+		return -ENOMEM;
+	read_seqlock_excl(&u->lock);
+	hb->len = kfifo_out_peek(&u->history, hb->samples, kfifo_size(&u->history))*sizeof(struct ups_sample);
+	read_sequnlock_excl(&u->lock);
+	file->private_data = hb;
 	return 0;
 }
 
-static int param_get_battery_status(char *buffer, const struct kernel_param *kp){
-	strcpy(buffer, map_get_key(map_status, battery_status, "unknown"));
-	return strlen(buffer);
+static ssize_t ups_history_read(struct file *file,char __user *buf,size_t count,loff_t *ppos){
+	struct ups_history_buf *hb = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, hb->samples, hb->len);
 }
 
-//static int param_set_battery_present(const char *key,const struct kernel_param *kp){
-//	battery_present = map_get_value(map_present, key, battery_present);
-//	signal_power_supply_changed(ups_supplies[EXTERNAL]);
-//	return 0;
-//}
-//
-//static int param_get_battery_present(char *buffer,const struct kernel_param *kp){
-//	strcpy(buffer, map_get_key(map_present, battery_present, "unknown"));
-//	return strlen(buffer);
-//}
+static int ups_history_release(struct inode *inode,struct file *file){
+	kvfree(file->private_data);
+	return 0;
+}
 
-static int param_set_battery_present(const char *buffer,const struct kernel_param *kp){
-	int bat;
+static const struct file_operations ups_history_fops = {
+	.owner = THIS_MODULE,
+	.open = ups_history_open,
+	.read = ups_history_read,
+	.release = ups_history_release,
+};
 
-	if (1 != sscanf(buffer, "%d", &bat))
-		return -EINVAL;
+// Set up and register one unit. On failure everything done so far is undone by ups_unit_exit().
+static int ups_unit_init(struct ups_unit *u,int id){
+	char hname[16];
+	int i,ret;
+
+	u->id = id;
+	INIT_DELAYED_WORK(&u->notify_dwork, ups_notify_work);
+
+	for (i = 0; i < POWERSOURCE_COUNT; i++) {
+		if (id)
+			snprintf(u->name[i], sizeof(u->name[i]), "%s%d", ups_desc[i].name, id);
+		else
+			strscpy(u->name[i], ups_desc[i].name, sizeof(u->name[i]));
+		u->desc[i] = ups_desc[i];
+		u->desc[i].name = u->name[i];
+		u->config[i].drv_data = u;
+	}
+	u->supplied_to[0] = u->name[BATTERY];
+	u->config[EXTERNAL].supplied_to = u->supplied_to;
+	u->config[EXTERNAL].num_supplicants = ARRAY_SIZE(u->supplied_to);
+
+	for (i = 0; i < POWERSOURCE_COUNT; i++) {
+		u->supplies[i] = power_supply_register(NULL, &u->desc[i], &u->config[i]);
+		if (IS_ERR(u->supplies[i])) {
+			printk(KERN_ERR "UPS: %s: failed to register %s\n", __func__,u->name[i]);
+			ret = PTR_ERR(u->supplies[i]);
+			u->supplies[i] = NULL;
+			return ret;
+		}
+	}
 
-	if (bat==0||bat==1)	battery_present = bat;
-	else return -EINVAL;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
+	if (history_size) {
+		ret = kfifo_alloc(&u->history, history_size, GFP_KERNEL);
+		if (ret)
+			return ret;
+	}
+	if (id)
+		snprintf(hname, sizeof(hname), "history%d", id);
+	else
+		strscpy(hname, "history", sizeof(hname));
+	debugfs_create_file(hname, 0400, ups_debugfs, u, &ups_history_fops);
+
+	ups_get_state(u, &u->notified);
+	u->notified_at = jiffies;
+
+	if (id)
+		snprintf(u->dev_name, sizeof(u->dev_name), "ups%d", id);
+	else
+		strscpy(u->dev_name, "ups", sizeof(u->dev_name));
+	u->dev.minor = MISC_DYNAMIC_MINOR;
+	u->dev.name = u->dev_name;
+	u->dev.fops = &ups_dev_fops;
+	u->dev.mode = 0444;
+	ret = misc_register(&u->dev);
+	if (ret) {
+		printk(KERN_ERR "UPS: %s: failed to register /dev/%s\n", __func__,u->dev_name);
+		return ret;
+	}
+	u->dev_registered = true;
 	return 0;
 }
 
-#define param_get_battery_present param_get_int
-
-static int param_set_battery_percentage(const char *buffer,const struct kernel_param *kp){
-	int cap;
+// Report a unit as gone. Its supplies stay registered until ups_unit_exit().
+static void ups_unit_reset(struct ups_unit *u){
+	int i;
 
-	if (1 != sscanf(buffer, "%d", &cap))
-		return -EINVAL;
+	cancel_delayed_work_sync(&u->notify_dwork);
+	if (u->dev_registered)
+		misc_deregister(&u->dev);
+	u->dev_registered = false;
 
-	if (cap<0||cap>100) return -EINVAL;
-	battery_percentage = cap;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
-	return 0;
+	/* Let's see how we handle changes... */
+	write_seqlock(&u->lock);
+	u->state.external_online = 1;
+	u->state.battery_status = POWER_SUPPLY_STATUS_UNKNOWN;
+	u->state.battery_present = 0;
+	u->state.et_charge = -1;
+	u->state.et_discharge = -1;
+	u->state.stale = 0;
+	u->state.sampled = 0;
+	ups_state_unlock(u);
+	for (i = 0; i < POWERSOURCE_COUNT; i++)
+		if (u->supplies[i])
+			power_supply_changed(u->supplies[i]);
 }
 
-#define param_get_battery_percentage param_get_int
+// Deliver the change events queued by ups_unit_reset(). Unregistering a supply would cancel them.
+static void ups_unit_flush(struct ups_unit *u){
+	int i;
 
-static int param_set_battery_energy(const char *buffer,const struct kernel_param *kp){
-	int cap;
+	for (i = 0; i < POWERSOURCE_COUNT; i++)
+		if (u->supplies[i])
+			flush_work(&u->supplies[i]->changed_work);
+}
 
-	if (1 != sscanf(buffer, "%d", &cap))
-		return -EINVAL;
+static void ups_unit_exit(struct ups_unit *u){
+	int i;
 
-	battery_energy = cap;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
-	return 0;
+	cancel_delayed_work_sync(&u->notify_dwork);
+	if (u->dev_registered)
+		misc_deregister(&u->dev);
+	u->dev_registered = false;
+	for (i = 0; i < POWERSOURCE_COUNT; i++)
+		if (u->supplies[i])
+			power_supply_unregister(u->supplies[i]);
+	kfifo_free(&u->history);
 }
 
-#define param_get_battery_energy param_get_int
+// Module initialization. Test and start serial communication with UPS module.
 
-static int param_set_output_voltage(const char *buffer,const struct kernel_param *kp){
-	int vlt;
+static int __init ups_init(void){
+	unsigned int size;
+	int i;
+	int ret;
 
-	if (1 != sscanf(buffer, "%d", &vlt))
+	if (units<1||units>UPS_MAX_UNITS) {
+		printk(KERN_ERR "UPS: %s: units must be between 1 and %d\n", __func__,UPS_MAX_UNITS);
 		return -EINVAL;
+	}
 
-	output_voltage = vlt;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
+	// kfifo_alloc() fails below 2 samples and rounds anything else down to a power of 2.
+	if (history_size) {
+		size = roundup_pow_of_two(clamp(history_size, 2U, UPS_MAX_HISTORY));
+		if (size != history_size)
+			printk(KERN_WARNING "UPS: %s: history_size %u changed to %u\n", __func__,history_size,size);
+		history_size = size;
+	}
+
+	ups_debugfs = debugfs_create_dir("UPS_powermod", NULL);
+	debugfs_create_file("stats", 0400, ups_debugfs, NULL, &ups_stats_fops);
+
+	for (i = 0; i < units; i++) {
+		ret = ups_unit_init(&ups_units[i], i);
+		if (ret) {
+			i++;
+			goto failed;
+		}
+	}
+
+	if (ldisc) {
+		ret = ups_ldisc_register();
+		if (ret) {
+			printk(KERN_ERR "UPS: %s: failed to register line discipline %d\n", __func__,ldisc);
+			goto failed;
+		}
+	}
+
+	module_initialized = true;
 	return 0;
+failed:
+	debugfs_remove_recursive(ups_debugfs);
+	while (--i >= 0)
+		ups_unit_exit(&ups_units[i]);
+	return ret;
 }
 
-#define param_get_output_voltage param_get_int
 
-static int param_set_et_charge(const char *buffer,const struct kernel_param *kp){
-	int t;
+// Module termination. End serial communication.
 
-	if (1 != sscanf(buffer, "%d", &t))
-		return -EINVAL;
+static void __exit ups_exit(void){
+	int i;
+
+	if (ldisc)
+		ups_ldisc_unregister();
+	module_initialized = false;
+	debugfs_remove_recursive(ups_debugfs);
+	for (i = 0; i < units; i++)
+		ups_unit_reset(&ups_units[i]);
+	for (i = 0; i < units; i++)
+		ups_unit_flush(&ups_units[i]);
+	printk(KERN_WARNING "UPS: Module unloading. Power parameters reset.\n");
+
+	for (i = 0; i < units; i++)
+		ups_unit_exit(&ups_units[i]);
+}
+
+
+// Count and trace a rejected parameter write.
+static int ups_param_reject(const struct kernel_param *kp,const char *buffer){
+	ups_stat_inc(param_rejects);
+	trace_ups_param_reject(kp->name, buffer);
+	return -EINVAL;
+}
 
-	et_charge = t;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
+/*
+ * Per-field parameters of unit 0, generated from UPS_FIELDS. A write is
+ * parsed and range checked like the same field of a batched update.
+ */
+#define UPS_FIELD_PARAM(c,name,kind,min,max,batched,desc) \
+static int param_set_##name(const char *buffer,const struct kernel_param *kp){ \
+	struct ups_unit *u = ups_units; \
+	const char *p = buffer; \
+	int v; \
+\
+	ups_stat_inc(param_writes); \
+	if (UPS_FIELD_PARSE(&p, &v, kind, min, max) || *ups_skip_space(p)) \
+		return ups_param_reject(kp, buffer); \
+	write_seqlock(&u->lock); \
+	u->state.name = v; \
+	ups_state_unlock(u); \
+	signal_power_supply_changed(u); \
+	return 0; \
+} \
+static int param_get_##name(char *buffer,const struct kernel_param *kp){ \
+	return sprintf(buffer, UPS_FMT_##kind "\n" UPS_ARG_##kind(READ_ONCE(ups_units[0].state.name))); \
+} \
+static const struct kernel_param_ops param_ops_##name = { \
+	.set = param_set_##name, \
+	.get = param_get_##name, \
+}; \
+module_param_cb(name, &param_ops_##name, NULL, 0644); \
+MODULE_PARM_DESC(name, desc);
+
+// The per-field parameters and "state" address unit 0; "unit_state" and "unit_present" address any unit.
+UPS_FIELDS(UPS_FIELD_PARAM,)
+
+// Batched update of every sampled field. All values are validated before any of them is committed and a single change notification is sent.
+static int param_set_state(const char *buffer,const struct kernel_param *kp){
+	const char *p = buffer;
+	struct ups_fields v;
+	int stale;
+	u64 sampled;
+
+	ups_stat_inc(param_writes);
+	if (ups_parse_state(&p, &v) || ups_parse_state_flags(p, &stale, &sampled))
+		return ups_param_reject(kp, buffer);
+
+	ups_update_state(ups_units, &v, stale, sampled);
 	return 0;
 }
 
-#define param_get_et_charge param_get_int
+// The batched fields of st in the format written, without a newline.
+static int ups_print_state(char *buffer,const struct ups_battery_state *st){
+	int len = sprintf(buffer, UPS_STATE_FMT UPS_STATE_ARGS(*st));
 
-static int param_set_et_discharge(const char *buffer,const struct kernel_param *kp){
-	int t;
+	return len-1+sprintf(buffer+len-1, "%s", st->stale?" stale":"");
+}
 
-	if (1 != sscanf(buffer, "%d", &t))
-		return -EINVAL;
+static int param_get_state(char *buffer,const struct kernel_param *kp){
+	struct ups_battery_state st;
 
-	et_discharge = t;
-	signal_power_supply_changed(ups_supplies[BATTERY]);
-	return 0;
+	ups_get_state(ups_units, &st);
+	return ups_print_state(buffer, &st);
 }
 
-#define param_get_et_discharge param_get_int
+// Batched update of any unit: "<unit> <status> <percentage> <voltage> <external_online> <et_charge> <et_discharge> [stale] [@<ns>]".
+static int param_set_unit_state(const char *buffer,const struct kernel_param *kp){
+	const char *p = buffer;
+	struct ups_fields v;
+	int unit,stale;
+	u64 sampled;
 
-static const struct kernel_param_ops param_ops_external_online = {
-	.set = param_set_external_online,
-	.get = param_get_external_online,
-};
+	ups_stat_inc(param_writes);
+	if (ups_parse_int(&p, &unit) || unit<0 || unit>=units ||
+	    ups_parse_state(&p, &v) || ups_parse_state_flags(p, &stale, &sampled))
+		return ups_param_reject(kp, buffer);
 
-static const struct kernel_param_ops param_ops_battery_status = {
-	.set = param_set_battery_status,
-	.get = param_get_battery_status,
-};
+	ups_update_state(&ups_units[unit], &v, stale, sampled);
+	return 0;
+}
 
-static const struct kernel_param_ops param_ops_battery_present = {
-	.set = param_set_battery_present,
-	.get = param_get_battery_present,
-};
+// One line per unit, in the format written.
+static int param_get_unit_state(char *buffer,const struct kernel_param *kp){
+	struct ups_battery_state st;
+	int i,len = 0;
 
-static const struct kernel_param_ops param_ops_battery_energy = {
-	.set = param_set_battery_energy,
-	.get = param_get_battery_energy,
-};
+	for (i = 0; i < units; i++) {
+		ups_get_state(&ups_units[i], &st);
+		len += sprintf(buffer+len, "%d ", i);
+		len += ups_print_state(buffer+len, &st);
+		buffer[len++] = '\n';
+	}
+	buffer[len] = '\0';
+	return len;
+}
 
-static const struct kernel_param_ops param_ops_battery_percentage = {
-	.set = param_set_battery_percentage,
-	.get = param_get_battery_percentage,
-};
+// Battery presence of any unit: "<unit> <0|1>".
+static int param_set_unit_present(const char *buffer,const struct kernel_param *kp){
+	struct ups_unit *u;
+	int unit,bat;
+
+	ups_stat_inc(param_writes);
+	if (2 != sscanf(buffer, "%d %d", &unit, &bat))
+		return ups_param_reject(kp, buffer);
+
+	if (unit<0||unit>=units||(bat!=0&&bat!=1))
+		return ups_param_reject(kp, buffer);
+	u = &ups_units[unit];
+	write_seqlock(&u->lock);
+	u->state.battery_present = bat;
+	ups_state_unlock(u);
+	signal_power_supply_changed(u);
+	return 0;
+}
 
-static const struct kernel_param_ops param_ops_output_voltage = {
-	.set = param_set_output_voltage,
-	.get = param_get_output_voltage,
-};
+static int param_get_unit_present(char *buffer,const struct kernel_param *kp){
+	int i,len = 0;
+
+	for (i = 0; i < units; i++)
+		len += sprintf(buffer+len, "%d %d\n", i, READ_ONCE(ups_units[i].state.battery_present));
+	return len;
+}
 
-static const struct kernel_param_ops param_ops_et_charge = {
-	.set = param_set_et_charge,
-	.get = param_get_et_charge,
+static const struct kernel_param_ops param_ops_state = {
+	.set = param_set_state,
+	.get = param_get_state,
 };
 
-static const struct kernel_param_ops param_ops_et_discharge = {
-	.set = param_set_et_discharge,
-	.get = param_get_et_discharge,
+static const struct kernel_param_ops param_ops_unit_state = {
+	.set = param_set_unit_state,
+	.get = param_get_unit_state,
 };
 
-#define param_check_external_online(name, p) __param_check(name, p, void);
-#define param_check_battery_status(name, p) __param_check(name, p, void);
-#define param_check_battery_present(name, p) __param_check(name, p, void);
-#define param_check_battery_energy(name, p) __param_check(name, p, void);
-#define param_check_battery_percentage(name, p) __param_check(name, p, void);
-#define param_check_output_voltage(name, p) __param_check(name, p, void);
-#define param_check_et_charge(name, p) __param_check(name, p, void);
-#define param_check_et_discharge(name, p) __param_check(name, p, void);
+static const struct kernel_param_ops param_ops_unit_present = {
+	.set = param_set_unit_present,
+	.get = param_get_unit_present,
+};
 
+module_param_cb(state, &param_ops_state, NULL, 0644);
+MODULE_PARM_DESC(state, "batched update <status> <percentage> <voltage> <external_online> <et_charge> <et_discharge> [stale] [@<ns>]");
 
-module_param(external_online, external_online, 0644);
-MODULE_PARM_DESC(external_online, "Charging state <0|1>");
+module_param_cb(unit_state, &param_ops_unit_state, NULL, 0644);
+MODULE_PARM_DESC(unit_state, "batched update of one unit <unit> <status> <percentage> <voltage> <external_online> <et_charge> <et_discharge> [stale] [@<ns>]");
 
-module_param(battery_status, battery_status, 0644);
-MODULE_PARM_DESC(battery_status,"battery status <charging|discharging|not-charging|full>");
+module_param_cb(unit_present, &param_ops_unit_present, NULL, 0644);
+MODULE_PARM_DESC(unit_present, "battery presence of one unit <unit> <0|1>");
 
-module_param(battery_present, battery_present, 0644);
-MODULE_PARM_DESC(battery_present,"battery presence state <0|1>");
+module_param(units, uint, 0444);
+MODULE_PARM_DESC(units, "number of UPS units to register (1-8); the per-field parameters above address unit 0");
 
-module_param(battery_energy, battery_energy, 0644);
-MODULE_PARM_DESC(battery_energy,"battery designed capacity (*0.01mWh)");
+module_param(notify_interval, uint, 0644);
+MODULE_PARM_DESC(notify_interval, "minimum interval between capacity/voltage change notifications (milliseconds)");
 
-module_param(battery_percentage, battery_percentage, 0644);
-MODULE_PARM_DESC(battery_percentage, "battery percentage (0-100)");
+module_param(notify_capacity_step, uint, 0644);
+MODULE_PARM_DESC(notify_capacity_step, "battery percentage change that triggers a notification");
 
-module_param(output_voltage, output_voltage, 0644);
-MODULE_PARM_DESC(output_voltage, "output voltage (millivolts)");
+module_param(notify_voltage_delta, uint, 0644);
+MODULE_PARM_DESC(notify_voltage_delta, "output voltage change that triggers a notification (millivolts)");
 
-module_param(et_charge, et_charge, 0644);
-MODULE_PARM_DESC(et_charge, "estimated charging time (seconds)");
+// Counters are read only, on the module command line too.
+static int param_set_stat(const char *buffer,const struct kernel_param *kp){
+	return -EPERM;
+}
 
-module_param(et_discharge, et_discharge, 0644);
-MODULE_PARM_DESC(et_discharge, "estimated charging time (seconds)");
+// A read-only parameter that sums one of the per-CPU event counters.
+#define UPS_STAT_PARAM(name, desc) \
+static int param_get_##name(char *buffer,const struct kernel_param *kp){ \
+	return sprintf(buffer, "%llu\n", ups_stat_sum(name)); \
+} \
+static const struct kernel_param_ops param_ops_##name = { \
+	.set = param_set_stat, \
+	.get = param_get_##name, \
+}; \
+module_param_cb(name, &param_ops_##name, NULL, 0444); \
+MODULE_PARM_DESC(name, desc);
+
+UPS_STAT_PARAM(notify_sent, "number of change notifications sent")
+UPS_STAT_PARAM(notify_suppressed, "number of state updates that did not send a notification")
+
+module_param(history_size, uint, 0444);
+MODULE_PARM_DESC(history_size, "number of samples kept in the debugfs history, rounded up to a power of 2 from 2 to 65536 (0 to disable)");
+
+module_param(ldisc, int, 0444);
+MODULE_PARM_DESC(ldisc, "line discipline number for in-kernel parsing of the UPS serial port (0 to disable)");
 
 MODULE_DESCRIPTION("Power supply kernel driver for Raspberry Pi UPSPack V3.");
 MODULE_AUTHOR("Jiaqi Yu <yjq17@hotmail.com>");
@@ -0,0 +1,64 @@
+/*
+ * Lock-free single-producer/single-consumer queue of parsed samples.
+ *
+ * UPS_comm reads the serial port on one thread and publishes on another, so a
+ * slow sink (sysfs, subscribers) can never stall the UART reads. The reader
+ * pushes, the publisher pops. When the queue is full the newest sample is
+ * dropped and counted; the maximum backlog seen is recorded as well.
+ */
+
+#ifndef UPS_QUEUE_H
+#define UPS_QUEUE_H
+
+#include "UPS_frame.h"
+
+#define UPS_QUEUE_SIZE 256// Must be a power of 2.
+
+struct ups_queue_item {
+	unsigned long long t;// CLOCK_MONOTONIC time the frame was parsed (nanoseconds).
+	unsigned long long rx;// CLOCK_MONOTONIC time the first byte of the frame was read.
+	unsigned long long boot;// The same in CLOCK_BOOTTIME, which keeps counting while suspended.
+	int unit;// Serial port the frame came from.
+	struct ups_frame frame;
+};
+
+struct ups_queue {
+	unsigned int head __attribute__((aligned(64)));// Written by the producer only.
+	unsigned long drops;
+	unsigned int max_backlog;
+	unsigned int tail __attribute__((aligned(64)));// Written by the consumer only.
+	struct ups_queue_item items[UPS_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
+static inline void ups_queue_init(struct ups_queue *q){
+	q->head = q->tail = 0;
+	q->drops = 0;
+	q->max_backlog = 0;
+}
+
+// Producer side. Returns -1 and counts a drop when the queue is full.
+static inline int ups_queue_push(struct ups_queue *q,const struct ups_queue_item *item){
+	unsigned int head = q->head;
+	unsigned int backlog = head-__atomic_load_n(&q->tail,__ATOMIC_ACQUIRE);
+
+	if (backlog==UPS_QUEUE_SIZE) {
+		q->drops++;
+		return -1;
+	}
+	q->items[head&(UPS_QUEUE_SIZE-1)] = *item;
+	__atomic_store_n(&q->head,head+1,__ATOMIC_RELEASE);
+	if (backlog+1>q->max_backlog) q->max_backlog = backlog+1;
+	return 0;
+}
+
+// Consumer side. Returns -1 when the queue is empty.
+static inline int ups_queue_pop(struct ups_queue *q,struct ups_queue_item *item){
+	unsigned int tail = q->tail;
+
+	if (tail==__atomic_load_n(&q->head,__ATOMIC_ACQUIRE)) return -1;
+	*item = q->items[tail&(UPS_QUEUE_SIZE-1)];
+	__atomic_store_n(&q->tail,tail+1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+#endif
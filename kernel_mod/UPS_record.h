@@ -0,0 +1,43 @@
+/*
+ * Binary battery state record returned by reads from /dev/ups.
+ *
+ * Each read() returns exactly one record. The first read on an open file
+ * returns the current state at once; later reads block, and poll() reports
+ * the device readable, only once the state has been updated again.
+ *
+ * The sample history in debugfs (UPS_powermod/history) is an array of
+ * struct ups_sample, oldest first.
+ */
+
+#ifndef UPS_RECORD_H
+#define UPS_RECORD_H
+
+#include <linux/types.h>
+
+struct ups_record {
+	__u64 seq;// Incremented on every state update.
+	__u64 timestamp;// CLOCK_MONOTONIC time of the update (nanoseconds).
+	__s32 battery_status;// POWER_SUPPLY_STATUS_* value.
+	__s32 battery_percentage;
+	__s32 output_voltage;// millivolts
+	__s32 external_online;
+	__s32 battery_present;
+	__s32 battery_energy;// *0.01mWh
+	__s32 et_charge;// seconds, -1 if unknown
+	__s32 et_discharge;// seconds, -1 if unknown
+	__u32 flags;// UPS_RECORD_* bits.
+	__u32 reserved;
+	__u64 sampled;// CLOCK_MONOTONIC time the first byte of the sample was read, 0 if unknown.
+};
+
+#define UPS_RECORD_STALE 1// Restored from a snapshot at startup, not read from the UPS yet.
+
+struct ups_sample {
+	__u64 timestamp;// CLOCK_MONOTONIC time the sample was read, or of the update if that is unknown (nanoseconds).
+	__s32 battery_status;
+	__s32 battery_percentage;
+	__s32 output_voltage;
+	__s32 external_online;
+};
+
+#endif
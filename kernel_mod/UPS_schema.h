@@ -0,0 +1,198 @@
+/*
+ * Schema of the battery state fields shared by UPS_powermod and UPS_comm.
+ *
+ * UPS_FIELDS lists every field once, with its kind, valid range, whether it
+ * is part of a batched "state" update (in the order written) and its
+ * parameter description. The module generates its per-field parameters and
+ * the batched parser from it, and UPS_comm the format of its state writes.
+ * A new field is added here and, if it is exported, to the power_supply
+ * property list in UPS_powermod.c.
+ *
+ * Status names are looked up with a perfect hash on their length. A name
+ * that collides with another one fails to compile in ups_status_hash_check().
+ *
+ * Like UPS_frame.h this header has no libc dependency.
+ */
+
+#ifndef UPS_SCHEMA_H
+#define UPS_SCHEMA_H
+
+#include "UPS_frame.h"
+
+#define UPS_INT_MIN (-2147483647-1)
+#define UPS_INT_MAX 2147483647
+
+// X(value,name) for every battery status.
+#define UPS_STATUSES(X) \
+	X(UPS_STATUS_UNKNOWN,"unknown") \
+	X(UPS_STATUS_CHARGING,"charging") \
+	X(UPS_STATUS_DISCHARGING,"discharging") \
+	X(UPS_STATUS_NOT_CHARGING,"not-charging") \
+	X(UPS_STATUS_FULL,"full")
+
+// X(c,name,kind,min,max,batched,description) for every field, where c is passed through. kind is STATUS or INT.
+#define UPS_FIELDS(X,c) \
+	X(c,battery_status,STATUS,UPS_STATUS_UNKNOWN,UPS_STATUS_FULL,1,"battery status <unknown|charging|discharging|not-charging|full>") \
+	X(c,battery_percentage,INT,0,100,1,"battery percentage (0-100)") \
+	X(c,output_voltage,INT,UPS_INT_MIN,UPS_INT_MAX,1,"output voltage (millivolts)") \
+	X(c,external_online,INT,0,1,1,"Charging state <0|1>") \
+	X(c,et_charge,INT,UPS_INT_MIN,UPS_INT_MAX,1,"estimated charging time (seconds)") \
+	X(c,et_discharge,INT,UPS_INT_MIN,UPS_INT_MAX,1,"estimated discharging time (seconds)") \
+	X(c,battery_present,INT,0,1,0,"battery presence state <0|1>") \
+	X(c,battery_energy,INT,UPS_INT_MIN,UPS_INT_MAX,0,"battery designed capacity (*0.01mWh)")
+
+#define UPS_IF_0(x)
+#define UPS_IF_1(x) x
+
+#define UPS_FIELD_DECLARE(c,name,kind,min,max,batched,desc) int name;
+
+struct ups_fields {
+	UPS_FIELDS(UPS_FIELD_DECLARE,)
+};
+
+#define UPS_STATUS_HASH_SIZE 9
+#define UPS_STATUS_HASH(len) ((len)%UPS_STATUS_HASH_SIZE)
+
+struct ups_status_slot {
+	const char *name;
+	unsigned int len;
+	int value;
+};
+
+static const char *const ups_status_names[] = {
+#define UPS_STATUS_NAME(value,name) [value] = name,
+	UPS_STATUSES(UPS_STATUS_NAME)
+#undef UPS_STATUS_NAME
+};
+
+static const struct ups_status_slot ups_status_slots[UPS_STATUS_HASH_SIZE] = {
+#define UPS_STATUS_SLOT(value,name) [UPS_STATUS_HASH(sizeof(name)-1)] = {name,sizeof(name)-1,value},
+	UPS_STATUSES(UPS_STATUS_SLOT)
+#undef UPS_STATUS_SLOT
+};
+
+// Never called; a duplicate case value here means two status names share a hash slot.
+static inline void ups_status_hash_check(void){
+	switch (0) {
+#define UPS_STATUS_CASE(value,name) case UPS_STATUS_HASH(sizeof(name)-1):
+	UPS_STATUSES(UPS_STATUS_CASE)
+#undef UPS_STATUS_CASE
+		break;
+	}
+}
+
+static inline const char *ups_status_name(int value){
+	return value>=0&&value<(int)(sizeof(ups_status_names)/sizeof(*ups_status_names))?ups_status_names[value]:"unknown";
+}
+
+// Status named by the len bytes at s, ignoring case, or -1.
+static inline int ups_status_lookup(const char *s,unsigned int len){
+	const struct ups_status_slot *e = &ups_status_slots[UPS_STATUS_HASH(len)];
+	unsigned int i;
+	char c;
+
+	if (!e->name||e->len!=len) return -1;
+	for (i=0;i<len;i++) {
+		c = s[i];
+		if (c>='A'&&c<='Z') c += 'a'-'A';
+		if (c!=e->name[i]) return -1;
+	}
+	return e->value;
+}
+
+static inline int ups_is_space(char c){
+	return c==' '||c=='\t'||c=='\n';
+}
+
+static inline const char *ups_skip_space(const char *p){
+	while (ups_is_space(*p)) p++;
+	return p;
+}
+
+// Parse the decimal token at *p and move *p past it. Returns -1 if it is not a number that fits in limit.
+static inline int ups_parse_decimal(const char **p,unsigned long long limit,unsigned long long *v,int *neg){
+	const char *s = ups_skip_space(*p);
+
+	*v = 0;
+	*neg = *s=='-';
+	if (*s=='-'||*s=='+') s++;
+	if (*s<'0'||*s>'9') return -1;
+	while (*s>='0'&&*s<='9') {
+		if (*v>(limit-(*s-'0'))/10) return -1;
+		*v = *v*10+(*s++-'0');
+	}
+	if (*s&&!ups_is_space(*s)) return -1;
+	*p = s;
+	return 0;
+}
+
+static inline int ups_parse_int(const char **p,int *v){
+	unsigned long long n;
+	int neg;
+
+	if (ups_parse_decimal(p,(unsigned long long)UPS_INT_MAX+1,&n,&neg)||(!neg&&n>UPS_INT_MAX)) return -1;
+	*v = neg?(int)-(long long)n:(int)n;
+	return 0;
+}
+
+static inline int ups_parse_status(const char **p,int *v){
+	const char *s = ups_skip_space(*p),*e = s;
+
+	while (*e&&!ups_is_space(*e)) e++;
+	if ((*v = ups_status_lookup(s,e-s))<0) return -1;
+	*p = e;
+	return 0;
+}
+
+// Parse one field of the given kind and check its range; nonzero on failure.
+#define UPS_PARSE_STATUS(p,v) ups_parse_status(p,v)
+#define UPS_PARSE_INT(p,v) ups_parse_int(p,v)
+#define UPS_FIELD_PARSE(p,v,kind,min,max) (UPS_PARSE_##kind(p,v)||*(v)<(min)||*(v)>(max))
+
+// Parse the fields of a batched update at *p and move *p past them. The other fields of f are left alone.
+static inline int ups_parse_state(const char **p,struct ups_fields *f){
+#define UPS_STATE_PARSE(f,name,kind,min,max,batched,desc) UPS_IF_##batched(if (UPS_FIELD_PARSE(p,&(f)->name,kind,min,max)) return -1;)
+	UPS_FIELDS(UPS_STATE_PARSE,f)
+#undef UPS_STATE_PARSE
+	return 0;
+}
+
+/*
+ * Optional tokens after the values of a batched update: "stale" marks values
+ * restored from a snapshot, which the next update without it clears, and
+ * "@<ns>" gives the CLOCK_MONOTONIC time the sample was read, 0 if absent.
+ */
+static inline int ups_parse_state_flags(const char *p,int *stale,unsigned long long *sampled){
+	int neg;
+
+	*stale = 0;
+	*sampled = 0;
+	while (*(p = ups_skip_space(p))) {
+		if (*p=='@') {
+			p++;
+			if (ups_parse_decimal(&p,~0ULL,sampled,&neg)||neg) return -1;
+		}
+		else if (p[0]=='s'&&p[1]=='t'&&p[2]=='a'&&p[3]=='l'&&p[4]=='e'&&(!p[5]||ups_is_space(p[5]))) {
+			*stale = 1;
+			p += 5;
+		}
+		else return -1;
+	}
+	return 0;
+}
+
+/*
+ * printf format and arguments of the fields of a batched update of struct s,
+ * each one followed by a space:
+ *   sprintf(buf,UPS_STATE_FMT "@%llu" UPS_STATE_ARGS(values),t);
+ */
+#define UPS_FMT_STATUS "%s"
+#define UPS_FMT_INT "%d"
+#define UPS_ARG_STATUS(v) ,ups_status_name(v)
+#define UPS_ARG_INT(v) ,(v)
+#define UPS_STATE_FMT_FIELD(s,name,kind,min,max,batched,desc) UPS_IF_##batched(UPS_FMT_##kind " ")
+#define UPS_STATE_ARG_FIELD(s,name,kind,min,max,batched,desc) UPS_IF_##batched(UPS_ARG_##kind((s).name))
+#define UPS_STATE_FMT UPS_FIELDS(UPS_STATE_FMT_FIELD,)
+#define UPS_STATE_ARGS(s) UPS_FIELDS(UPS_STATE_ARG_FIELD,s)
+
+#endif
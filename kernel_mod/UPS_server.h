@@ -0,0 +1,285 @@
+/*
+ * Push subscription server for UPS_comm.
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix socket (UPS_SERVER_PATH, or the
+ * UPS_SOCKET environment variable) and are sent one message per event:
+ *   <event> <status> <percentage> <voltage> <external_online> <et_charge> <et_discharge>\n
+ * where event is one of
+ *   snapshot   current state, sent once right after connecting
+ *   status     battery status or external power changed
+ *   percentage battery percentage moved by UPS_SERVER_PCT_STEP since the last event
+ *   voltage    output voltage crossed a multiple of UPS_SERVER_VOLT_STEP
+ * Every message carries the full state, so a client that cannot keep up is
+ * simply sent the latest state once its socket is writable again.
+ *
+ * Connecting needs write permission on the socket file. It is created with
+ * mode UPS_SERVER_MODE, or the octal UPS_SOCKET_MODE environment variable, and
+ * is given to the group named by UPS_SOCKET_GROUP if set, so that shutdown
+ * agents need not run as root. A user may hold at most UPS_SERVER_MAX_PER_UID
+ * connections, or UPS_SOCKET_PER_UID, so that one of them cannot take every
+ * slot from the others.
+ *
+ * All sockets are non-blocking and served from the same epoll set that wakes
+ * the publisher for new samples, so idle subscribers cost nothing and the
+ * serial reader never waits on them.
+ */
+
+#ifndef UPS_SERVER_H
+#define UPS_SERVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <grp.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UPS_SERVER_PATH "/run/UPS_comm.sock"
+#define UPS_SERVER_MAX_CLIENTS 1024
+#define UPS_SERVER_MODE 0660
+#define UPS_SERVER_MAX_PER_UID 16
+#define UPS_SERVER_PCT_STEP 1
+#define UPS_SERVER_VOLT_STEP 100
+
+enum ups_server_kind {UPS_EP_SOURCE,UPS_EP_LISTEN,UPS_EP_CLIENT};
+
+struct ups_server {
+	int ep;// epoll set shared with the sample source.
+	int listen;// -1 when the server is disabled.
+	int nclients;
+	int top;// One past the highest slot in use, so that publishing does not scan free slots.
+	int fd[UPS_SERVER_MAX_CLIENTS];// -1 for a free slot.
+	uid_t uid[UPS_SERVER_MAX_CLIENTS];// Peer of each client.
+	int per_uid;// Connections allowed per peer uid.
+	char pending[UPS_SERVER_MAX_CLIENTS];// The latest message could not be sent yet.
+	int valid;// A state has been published.
+	int stat,ext,bat,vbucket;// State at the last event.
+	char state[64];// Current state, without the event name.
+	unsigned long events,sent,deferred;
+};
+
+static inline uint64_t ups_server_tag(int kind,int index){
+	return (uint64_t)kind<<32|(uint32_t)index;
+}
+
+static inline const char *ups_server_path(){
+	const char *path = getenv("UPS_SOCKET");
+	return path?path:UPS_SERVER_PATH;
+}
+
+// Set the mode and group of the socket file. bind() creates it under the umask.
+static inline int ups_server_perms(const char *path){
+	const char *mode = getenv("UPS_SOCKET_MODE"),*group = getenv("UPS_SOCKET_GROUP");
+	struct group *g;
+
+	if (chmod(path,mode?(mode_t)strtoul(mode,NULL,8):UPS_SERVER_MODE)) return -1;
+	if (!group) return 0;
+	g = getgrnam(group);
+	if (!g) {
+		errno = ENOENT;
+		return -1;
+	}
+	return chown(path,-1,g->gr_gid);
+}
+
+// Create the epoll set and add the sample source fd. The listening socket is optional; on failure the server stays disabled.
+static inline int ups_server_init(struct ups_server *s,int source,const char *path){
+	struct epoll_event ev;
+	struct sockaddr_un addr;
+	int i;
+
+	memset(s,0,sizeof(*s));
+	s->listen = -1;
+	s->per_uid = getenv("UPS_SOCKET_PER_UID")?atoi(getenv("UPS_SOCKET_PER_UID")):0;
+	if (s->per_uid<1) s->per_uid = UPS_SERVER_MAX_PER_UID;
+	for (i=0;i<UPS_SERVER_MAX_CLIENTS;i++) s->fd[i] = -1;
+
+	s->ep = epoll_create1(EPOLL_CLOEXEC);
+	if (s->ep<0) return -1;
+	ev.events = EPOLLIN;
+	ev.data.u64 = ups_server_tag(UPS_EP_SOURCE,0);
+	if (epoll_ctl(s->ep,EPOLL_CTL_ADD,source,&ev)) return -1;
+
+	if (!path||strlen(path)>=sizeof(addr.sun_path)) return 0;
+	s->listen = socket(AF_UNIX,SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if (s->listen<0) return 0;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	unlink(path);
+	ev.events = EPOLLIN;
+	ev.data.u64 = ups_server_tag(UPS_EP_LISTEN,0);
+	if (bind(s->listen,(struct sockaddr *)&addr,sizeof(addr))||ups_server_perms(path)||listen(s->listen,64)||epoll_ctl(s->ep,EPOLL_CTL_ADD,s->listen,&ev)) {
+		fprintf(stderr,"UPS: Warning: Error %d serving %s: %s\n",errno,path,strerror(errno));
+		close(s->listen);
+		s->listen = -1;
+	}
+	return 0;
+}
+
+static inline void ups_server_drop(struct ups_server *s,int i){
+	close(s->fd[i]);// Also removes it from the epoll set.
+	s->fd[i] = -1;
+	s->pending[i] = 0;
+	s->nclients--;
+	while (s->top>0&&s->fd[s->top-1]<0) s->top--;
+}
+
+// Send msg to client i. A client whose socket is full is sent the latest state once it becomes writable.
+static inline void ups_server_send(struct ups_server *s,int i,const char *msg,int len){
+	struct epoll_event ev;
+
+	if (send(s->fd[i],msg,len,MSG_DONTWAIT|MSG_NOSIGNAL)==len) {
+		s->sent++;
+		if (s->pending[i]) {
+			s->pending[i] = 0;
+			ev.events = EPOLLIN;
+			ev.data.u64 = ups_server_tag(UPS_EP_CLIENT,i);
+			epoll_ctl(s->ep,EPOLL_CTL_MOD,s->fd[i],&ev);
+		}
+		return;
+	}
+	if (errno!=EAGAIN&&errno!=EWOULDBLOCK) {
+		ups_server_drop(s,i);
+		return;
+	}
+	s->deferred++;
+	if (!s->pending[i]) {
+		s->pending[i] = 1;
+		ev.events = EPOLLIN|EPOLLOUT;
+		ev.data.u64 = ups_server_tag(UPS_EP_CLIENT,i);
+		epoll_ctl(s->ep,EPOLL_CTL_MOD,s->fd[i],&ev);
+	}
+}
+
+static inline void ups_server_accept(struct ups_server *s){
+	struct epoll_event ev;
+	struct ucred cred;
+	socklen_t credlen;
+	char msg[80];
+	int fd,i,n,len;
+
+	while ((fd = accept4(s->listen,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC))>=0) {
+		credlen = sizeof(cred);
+		if (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&credlen)) {
+			close(fd);
+			continue;
+		}
+		for (i=0,n=0;i<s->top;i++)
+			if (s->fd[i]>=0&&s->uid[i]==cred.uid) n++;
+		if (n>=s->per_uid) {
+			close(fd);
+			continue;
+		}
+		for (i=0;i<UPS_SERVER_MAX_CLIENTS&&s->fd[i]>=0;i++);
+		if (i==UPS_SERVER_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u64 = ups_server_tag(UPS_EP_CLIENT,i);
+		if (epoll_ctl(s->ep,EPOLL_CTL_ADD,fd,&ev)) {
+			close(fd);
+			continue;
+		}
+		s->fd[i] = fd;
+		s->uid[i] = cred.uid;
+		s->nclients++;
+		if (i>=s->top) s->top = i+1;
+		// Late joiners get the current state at once.
+		if (s->valid) {
+			len = snprintf(msg,sizeof(msg),"snapshot %s",s->state);
+			ups_server_send(s,i,msg,len);
+		}
+	}
+}
+
+static inline void ups_server_client(struct ups_server *s,int i,uint32_t events){
+	char buf[64],msg[80];
+	int len;
+
+	if (s->fd[i]<0) return;
+	if (events&EPOLLOUT) {
+		len = snprintf(msg,sizeof(msg),"snapshot %s",s->state);
+		ups_server_send(s,i,msg,len);
+		if (s->fd[i]<0) return;
+	}
+	// Subscribers have nothing to say; any input is discarded and EOF ends the subscription.
+	if (events&(EPOLLIN|EPOLLHUP|EPOLLERR)) {
+		len = recv(s->fd[i],buf,sizeof(buf),MSG_DONTWAIT);
+		if (len==0||(len<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK)) ups_server_drop(s,i);
+	}
+}
+
+// Serve subscribers until the sample source is readable. With a timeout in milliseconds (-1 for none), returns
+// after the first events or the timeout, so that the caller can recompute it.
+// Returns 1 when the source is readable, 0 when it is not yet and -1 on error.
+static inline int ups_server_wait(struct ups_server *s,int timeout){
+	struct epoll_event events[32];
+	int n,i,ready = 0;
+
+	while (!ready) {
+		n = epoll_wait(s->ep,events,32,timeout);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		for (i=0;i<n;i++) {
+			switch (events[i].data.u64>>32) {
+				case UPS_EP_SOURCE:
+					ready = 1;
+					break;
+				case UPS_EP_LISTEN:
+					ups_server_accept(s);
+					break;
+				case UPS_EP_CLIENT:
+					ups_server_client(s,(uint32_t)events[i].data.u64,events[i].events);
+					break;
+			}
+		}
+		if (timeout>=0) break;
+	}
+	return ready;
+}
+
+// Record a new sample and push an event to every subscriber if it is significant.
+static inline void ups_server_publish(struct ups_server *s,const char *status,int stat,int bat,int vlt,int ext,int etchg,int etdsc){
+	const char *event = NULL;
+	char msg[80];
+	int i,len,vbucket = vlt/UPS_SERVER_VOLT_STEP;
+
+	snprintf(s->state,sizeof(s->state),"%s %d %d %d %d %d\n",status,bat,vlt,ext,etchg,etdsc);
+	if (!s->valid||stat!=s->stat||ext!=s->ext) event = "status";
+	else if (abs(bat-s->bat)>=UPS_SERVER_PCT_STEP) event = "percentage";
+	else if (vbucket!=s->vbucket) event = "voltage";
+	s->valid = 1;
+	if (!event) return;
+
+	s->stat = stat;
+	s->ext = ext;
+	s->bat = bat;
+	s->vbucket = vbucket;
+	s->events++;
+	len = snprintf(msg,sizeof(msg),"%s %s",event,s->state);
+	for (i=0;i<s->top;i++)
+		if (s->fd[i]>=0) ups_server_send(s,i,msg,len);
+}
+
+static inline void ups_server_close(struct ups_server *s,const char *path){
+	int i;
+
+	for (i=s->top-1;i>=0;i--)
+		if (s->fd[i]>=0) ups_server_drop(s,i);
+	if (s->listen>=0) {
+		close(s->listen);
+		unlink(path);
+	}
+	close(s->ep);
+}
+
+#endif
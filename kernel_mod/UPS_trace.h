@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Tracepoints for UPS_powermod. With tracing off each one costs a patched-out
+ * branch, e.g.
+ *   trace-cmd record -e ups
+ *   perf stat -e 'ups:*' -a sleep 60
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ups
+
+#if !defined(UPS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define UPS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0)
+#define ups_assign_str(dst, src) __assign_str(dst)
+#else
+#define ups_assign_str(dst, src) __assign_str(dst, src)
+#endif
+
+// Every committed state update, from a parameter write or the line discipline.
+TRACE_EVENT(ups_state_update,
+	TP_PROTO(int unit, u64 seq, int status, int percentage, int voltage, int external_online, int et_charge, int et_discharge),
+	TP_ARGS(unit, seq, status, percentage, voltage, external_online, et_charge, et_discharge),
+	TP_STRUCT__entry(
+		__field(int, unit)
+		__field(u64, seq)
+		__field(int, status)
+		__field(int, percentage)
+		__field(int, voltage)
+		__field(int, external_online)
+		__field(int, et_charge)
+		__field(int, et_discharge)
+	),
+	TP_fast_assign(
+		__entry->unit = unit;
+		__entry->seq = seq;
+		__entry->status = status;
+		__entry->percentage = percentage;
+		__entry->voltage = voltage;
+		__entry->external_online = external_online;
+		__entry->et_charge = et_charge;
+		__entry->et_discharge = et_discharge;
+	),
+	TP_printk("unit=%d seq=%llu status=%d percentage=%d voltage=%d external_online=%d et_charge=%d et_discharge=%d",
+		__entry->unit, __entry->seq, __entry->status, __entry->percentage, __entry->voltage,
+		__entry->external_online, __entry->et_charge, __entry->et_discharge)
+);
+
+#define UPS_NOTIFY_SENT 0
+#define UPS_NOTIFY_DEFERRED 1
+#define UPS_NOTIFY_SUPPRESSED 2
+
+// What signal_power_supply_changed() decided for a state update.
+TRACE_EVENT(ups_notify,
+	TP_PROTO(int unit, u64 seq, int action),
+	TP_ARGS(unit, seq, action),
+	TP_STRUCT__entry(
+		__field(int, unit)
+		__field(u64, seq)
+		__field(int, action)
+	),
+	TP_fast_assign(
+		__entry->unit = unit;
+		__entry->seq = seq;
+		__entry->action = action;
+	),
+	TP_printk("unit=%d seq=%llu %s", __entry->unit, __entry->seq,
+		__print_symbolic(__entry->action,
+			{ UPS_NOTIFY_SENT, "sent" },
+			{ UPS_NOTIFY_DEFERRED, "deferred" },
+			{ UPS_NOTIFY_SUPPRESSED, "suppressed" }))
+);
+
+// A module parameter write rejected with -EINVAL.
+TRACE_EVENT(ups_param_reject,
+	TP_PROTO(const char *name, const char *value),
+	TP_ARGS(name, value),
+	TP_STRUCT__entry(
+		__string(name, name)
+		__string(value, value)
+	),
+	TP_fast_assign(
+		ups_assign_str(name, name);
+		ups_assign_str(value, value);
+	),
+	TP_printk("%s=\"%s\"", __get_str(name), __get_str(value))
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE UPS_trace
+#include <trace/define_trace.h>
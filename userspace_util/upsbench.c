@@ -0,0 +1,314 @@
+// Micro-benchmarks of the UPS parsers.
+//
+// Usage: upsbench [-f capture] [iterations]
+//
+// Frames: runs a corpus of SmartUPS frames through the ring buffer and
+// ups_parse_frame(), as UPS_comm does, and through the strstr()/sscanf() chain
+// it replaced, and reports frames/s and the share of frames rejected by each.
+// The corpus is a raw capture of the serial port given with -f (e.g.
+// `cat /dev/ttyAMA2 >capture`), or else generated frames of which one in
+// CORRUPT_EVERY is damaged.
+//
+// Setters: compares the generated parsers of UPS_schema.h with the sscanf()
+// and map_get_value() code they replaced, on the writes UPS_comm sends. Both
+// run in userspace, so glibc sscanf() stands in for the kernel vsscanf(); the
+// locking and change notification after parsing are the same for both and
+// are not measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "../kernel_mod/UPS_schema.h"
+
+#define CORPUS_FRAMES 4096
+#define CORRUPT_EVERY 8
+#define READ_CHUNK 32// Bytes per read() at 9600 baud with VMIN=1 rarely exceed this.
+
+#define MAX_KEYLENGTH 256
+
+struct battery_property_map {
+	int value;
+	char const *key;
+};
+
+static struct battery_property_map map_status[] = {
+	{ UPS_STATUS_UNKNOWN,      "unknown"      },
+	{ UPS_STATUS_CHARGING,     "charging"     },
+	{ UPS_STATUS_DISCHARGING,  "discharging"  },
+	{ UPS_STATUS_NOT_CHARGING, "not-charging" },
+	{ UPS_STATUS_FULL,         "full"         },
+	{ -1,                      NULL           },
+};
+
+// The old lookup, as it was in UPS_powermod.c.
+static int map_get_value(struct battery_property_map *map,const char *key,int def_val){
+	char buf[MAX_KEYLENGTH];
+	int cr;
+
+	strncpy(buf, key, MAX_KEYLENGTH);
+	buf[MAX_KEYLENGTH-1] = '\0';
+
+	cr = strnlen(buf, MAX_KEYLENGTH) - 1;
+	if (cr < 0)
+		return def_val;
+	if (buf[cr] == '\n')
+		buf[cr] = '\0';
+
+	while (map->key) {
+		if (strncasecmp(map->key, buf, MAX_KEYLENGTH) == 0)
+			return map->value;
+		map++;
+	}
+
+	return def_val;
+}
+
+// The old batched parser, with kstrtou64() replaced by strtoull().
+static int old_parse_state(const char *buffer,struct ups_fields *v,int *stale,unsigned long long *sampled){
+	char key[16],tok[24],*end;
+	int n,len;
+	const char *s;
+
+	n = sscanf(buffer, "%15s %d %d %d %d %d%n", key, &v->battery_percentage, &v->output_voltage, &v->external_online,
+		&v->et_charge, &v->et_discharge, &len);
+	if (n != 6) return -1;
+	*stale = 0;
+	*sampled = 0;
+	for (s=buffer+len;sscanf(s, "%23s%n", tok, &n) == 1;s += n) {
+		if (!strcmp(tok, "stale"))
+			*stale = 1;
+		else if (tok[0] != '@' || (*sampled = strtoull(tok+1, &end, 10), *end))
+			return -1;
+	}
+	v->battery_status = map_get_value(map_status, key, -1);
+	if (v->battery_status<0||v->battery_percentage<0||v->battery_percentage>100||(v->external_online!=0&&v->external_online!=1))
+		return -1;
+	return 0;
+}
+
+static int new_parse_state(const char *buffer,struct ups_fields *v,int *stale,unsigned long long *sampled){
+	const char *p = buffer;
+
+	return ups_parse_state(&p,v)||ups_parse_state_flags(p,stale,sampled)?-1:0;
+}
+
+static int old_parse_status(const char *buffer,int *v){
+	return (*v = map_get_value(map_status,buffer,-1))<0?-1:0;
+}
+
+static int new_parse_status(const char *buffer,int *v){
+	const char *p = buffer;
+
+	return UPS_FIELD_PARSE(&p,v,STATUS,UPS_STATUS_UNKNOWN,UPS_STATUS_FULL)||*ups_skip_space(p)?-1:0;
+}
+
+// The frame parsing of the original UPS_comm, on one line.
+static int old_parse_frame(const char *line,struct ups_frame *f){
+	const char *ptr;
+
+	if (!(ptr=strstr(line,"Vin"))) return -1;
+	if (strstr(ptr,"GOOD")) f->vin = 1;
+	else if (strstr(ptr,"NG")) f->vin = 0;
+	else return -1;
+	if (!(ptr=strstr(ptr,"BATCAP"))) return -1;
+	if (EOF==sscanf(ptr+6,"%d",&f->batcap)) return -1;
+	if (!(ptr=strstr(ptr,"Vout"))) return -1;
+	if (EOF==sscanf(ptr+4,"%d",&f->vout)) return -1;
+	return 0;
+}
+
+// Generate CORPUS_FRAMES frames, damaging every CORRUPT_EVERY-th one in one of several ways seen on a noisy line.
+static size_t make_corpus(char *buf,size_t size,int *corrupted){
+	unsigned int seed = 1;
+	size_t len = 0;
+	char frame[96];
+	int i,n,pos;
+
+	*corrupted = 0;
+	for (i=0;i<CORPUS_FRAMES;i++) {
+		n = snprintf(frame,sizeof(frame),"$ SmartUPS V3.2P,Vin %s,BATCAP %d,Vout %d $\r\n",i%3?"GOOD":"NG",50+i%51,5150+i%100);
+		if (i%CORRUPT_EVERY==CORRUPT_EVERY-1) {
+			seed = seed*1103515245+12345;
+			pos = 2+(seed>>16)%(n-6);
+			switch ((seed>>8)%4) {
+				case 0: frame[pos] ^= 0x20; break;// Flipped bit.
+				case 1: memmove(frame+pos,frame+pos+1,n-pos); n--; break;// Dropped byte.
+				case 2: n = pos; break;// Truncated, the next frame follows directly.
+				case 3: frame[pos] = '\xff'; break;// Framing error read as 0xff.
+			}
+			(*corrupted)++;
+		}
+		if (len+n>size) break;
+		memcpy(buf+len,frame,n);
+		len += n;
+	}
+	return len;
+}
+
+static double now_ns(void){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e9+t.tv_nsec;
+}
+
+static volatile long sink;
+
+static const char *writes[] = {
+	"discharging 86 5232 0 -1 -1 @4593798600502",
+	"charging 100 5225 1 0 -1 @4593798600502",
+	"not-charging 42 5170 1 5400 -1 @4593798600502",
+	"full 100 5241 1 -1 -1 stale",
+};
+#define NWRITES (sizeof(writes)/sizeof(*writes))
+
+static const char *statuses[] = {"discharging\n","charging\n","NOT-CHARGING\n","full\n"};
+
+// Feed the corpus through the ring in READ_CHUNK reads, as the reader thread does. Returns the frames accepted.
+static long ring_pass(const char *corpus,size_t size,unsigned int *found){
+	struct ups_ring ring;
+	struct ups_frame f;
+	unsigned int off,len,n;
+	size_t pos = 0;
+	long ok = 0;
+	char *ptr;
+
+	ups_ring_init(&ring);
+	*found = 0;
+	while (1) {
+		if (!ups_ring_next_frame(&ring,&off,&len)) {
+			if (pos>=size) break;
+			n = ups_ring_space(&ring,&ptr);
+			if (n>READ_CHUNK) n = READ_CHUNK;
+			if (n>size-pos) n = size-pos;
+			memcpy(ptr,corpus+pos,n);
+			pos += n;
+			ups_ring_commit(&ring,n);
+			continue;
+		}
+		(*found)++;
+		if (!ups_ring_parse(&ring,off,len,&f)) ok++;
+	}
+	return ok;
+}
+
+// The same corpus split into lines, as the original UPS_comm read it. Returns the frames accepted.
+static long line_pass(char *corpus,size_t size,unsigned int *found){
+	struct ups_frame f;
+	char *p = corpus,*end = corpus+size,*nl;
+	long ok = 0;
+
+	*found = 0;
+	while (p<end) {
+		nl = memchr(p,'\n',end-p);
+		if (!nl) break;
+		*nl = '\0';
+		(*found)++;
+		if (!old_parse_frame(p,&f)) ok++;
+		*nl = '\n';
+		p = nl+1;
+	}
+	return ok;
+}
+
+static void bench_frames(char *corpus,size_t size,int corrupted,long iterations){
+	unsigned int found;
+	long ok = 0,passes = 0,frames = 0;
+	double t0,t;
+
+	t0 = now_ns();
+	do {
+		ok = ring_pass(corpus,size,&found);
+		frames += found;
+		passes++;
+	} while (frames<iterations);
+	t = (now_ns()-t0)/passes;
+	printf("frames, ring:   %u frames, %.0f frames/s, %ld accepted, %.1f%% rejected\n",found,found/t*1e9,ok,100.0*(found-ok)/found);
+	sink += ok;
+
+	frames = passes = 0;
+	t0 = now_ns();
+	do {
+		ok = line_pass(corpus,size,&found);
+		frames += found;
+		passes++;
+	} while (frames<iterations);
+	t = (now_ns()-t0)/passes;
+	printf("frames, sscanf: %u lines, %.0f frames/s, %ld accepted, %.1f%% rejected\n",found,found/t*1e9,ok,100.0*(found-ok)/found);
+	if (corrupted>=0) printf("                %d of the frames were corrupted\n",corrupted);
+	sink += ok;
+}
+
+int main(int argc,char *argv[]){
+	long iterations;
+	static char corpus[1<<20];
+	const char *capture = NULL;
+	size_t size;
+	FILE *f;
+	int opt,corrupted = -1;
+	struct ups_fields a,b;
+	unsigned long long sa,sb;
+	int i,ra,rb,stale_a,stale_b,sum = 0;
+	double t0,t_old,t_new;
+	long n;
+
+	while ((opt = getopt(argc,argv,"f:"))!=-1) {
+		if (opt=='f') capture = optarg;
+		else {
+			printf("Invalid arguments!\n");
+			return -1;
+		}
+	}
+	iterations = optind<argc?atol(argv[optind]):2000000;
+	if (iterations<1) iterations = 1;
+
+	if (capture) {
+		f = fopen(capture,"rb");
+		if (!f) {
+			printf("Error %d opening %s: %s\n",errno,capture,strerror(errno));
+			return -1;
+		}
+		size = fread(corpus,1,sizeof(corpus),f);
+		fclose(f);
+	}
+	else size = make_corpus(corpus,sizeof(corpus),&corrupted);
+	bench_frames(corpus,size,corrupted,iterations/4);
+
+	// Both parsers must agree before they are timed.
+	for (i=0;i<(int)NWRITES;i++) {
+		memset(&a,0,sizeof(a));
+		memset(&b,0,sizeof(b));
+		stale_a = stale_b = 0;
+		sa = sb = 0;
+		ra = old_parse_state(writes[i],&a,&stale_a,&sa);
+		rb = new_parse_state(writes[i],&b,&stale_b,&sb);
+		if (ra!=rb||memcmp(&a,&b,sizeof(a))||stale_a!=stale_b||sa!=sb) {
+			printf("Parsers disagree on \"%s\"!\n",writes[i]);
+			return -1;
+		}
+	}
+
+	t0 = now_ns();
+	for (n=0;n<iterations;n++) sum += old_parse_state(writes[n%NWRITES],&a,&stale_a,&sa)+a.battery_status;
+	t_old = (now_ns()-t0)/iterations;
+	t0 = now_ns();
+	for (n=0;n<iterations;n++) sum += new_parse_state(writes[n%NWRITES],&b,&stale_b,&sb)+b.battery_status;
+	t_new = (now_ns()-t0)/iterations;
+	printf("state:          sscanf %6.1f ns, schema %6.1f ns, %.1fx\n",t_old,t_new,t_old/t_new);
+
+	t0 = now_ns();
+	for (n=0;n<iterations;n++) sum += old_parse_status(statuses[n%4],&ra)+ra;
+	t_old = (now_ns()-t0)/iterations;
+	t0 = now_ns();
+	for (n=0;n<iterations;n++) sum += new_parse_status(statuses[n%4],&rb)+rb;
+	t_new = (now_ns()-t0)/iterations;
+	printf("battery_status: map    %6.1f ns, schema %6.1f ns, %.1fx\n",t_old,t_new,t_old/t_new);
+
+	// Keeps the loops from being optimized away.
+	sink += sum;
+	return 0;
+}
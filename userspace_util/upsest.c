@@ -0,0 +1,214 @@
+// Score the time-to-empty/time-to-full estimator of UPS_estimate.h against recorded traces.
+//
+// Usage: upsest [-u unit] [-p period] [-s rate] [-v] trace
+//   trace is a telemetry log written by UPS_comm (UPS_LOG=path), e.g. recorded
+//   on the hardware or under upssim -s discharge, or a text file with one
+//   "<ms> <percentage> <external_online>" sample per line.
+//   -u replays only the given unit of a log (default 0).
+//   -p ms   The log only holds changes; the last sample is repeated every ms
+//           milliseconds in between, as the UPS sends it (default 1000, 0 to disable).
+//   -s rate Seed the discharge rate (ms per percent), as a saved state file would.
+//   -v prints every scored sample.
+//
+// The trace is cut into segments of constant external power. The ground truth
+// of a sample is the time the segment took from it until the percentage first
+// reached its final value, and the estimate is scaled to that same percentage
+// change. For every segment the share of samples that had an estimate, the
+// delay of the first one, and the mean, median and 90th percentile of the relative
+// error are reported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../kernel_mod/UPS_log.h"
+#include "../kernel_mod/UPS_estimate.h"
+
+struct sample {
+	unsigned long long t;// ms
+	int bat,ext;
+	int est;// Estimate (s) given after this sample, -1 if none.
+};
+
+static struct sample *samples;
+static size_t nsamples,size;
+
+static void add_sample(unsigned long long t,int bat,int ext){
+	if (nsamples==size) {
+		size = size?size*2:4096;
+		samples = realloc(samples,size*sizeof(*samples));
+		if (!samples) {
+			printf("Out of memory!\n");
+			exit(-1);
+		}
+	}
+	samples[nsamples].t = t;
+	samples[nsamples].bat = bat;
+	samples[nsamples].ext = ext;
+	samples[nsamples].est = -1;
+	nsamples++;
+}
+
+// Add the sample and, with a period, the repeats of the previous one up to it.
+static void add_held(unsigned long long t,int bat,int ext,unsigned long long period){
+	unsigned long long r;
+
+	if (nsamples&&period)
+		for (r=samples[nsamples-1].t+period;r<t;r+=period) add_sample(r,samples[nsamples-1].bat,samples[nsamples-1].ext);
+	add_sample(t,bat,ext);
+}
+
+static int load_log(const uint8_t *map,size_t len,int unit,unsigned long long period){
+	const uint8_t *b,*p,*end;
+	struct ups_log_codec codec;
+	struct ups_log_sample s;
+	size_t i;
+
+	for (i=0;i+UPS_LOG_BLOCK<=len;i+=UPS_LOG_BLOCK) {
+		b = map+i;
+		end = ups_log_block_end(b);
+		if (!end) continue;
+		ups_log_codec_reset(&codec,((const struct ups_log_header *)b)->first);
+		for (p=b+sizeof(struct ups_log_header);p<end;) {
+			if (ups_log_decode(&codec,&p,end,&s)) {
+				fprintf(stderr,"Corrupted record in block %zu.\n",i/UPS_LOG_BLOCK);
+				break;
+			}
+			if (s.unit==unit) add_held(s.time,s.percentage,s.external_online,period);
+		}
+	}
+	return 0;
+}
+
+static int load_text(const char *map,size_t len,unsigned long long period){
+	char line[128];
+	unsigned long long t;
+	const char *p = map,*nl;
+	int bat,ext;
+	size_t n;
+
+	while (p<map+len) {
+		nl = memchr(p,'\n',map+len-p);
+		n = (nl?nl:map+len)-p;
+		if (n>=sizeof(line)) n = sizeof(line)-1;
+		memcpy(line,p,n);
+		line[n] = '\0';
+		p = nl?nl+1:map+len;
+		if (line[0]=='#'||sscanf(line,"%llu %d %d",&t,&bat,&ext)!=3) continue;
+		add_held(t,bat,ext,period);
+	}
+	return 0;
+}
+
+static int cmp_double(const void *a,const void *b){
+	double x = *(const double *)a,y = *(const double *)b;
+	return (x>y)-(x<y);
+}
+
+// Score samples [from,to) of one segment. Returns the number of samples scored.
+static size_t score_segment(size_t from,size_t to,int verbose,double *errors,double *sum,size_t *covered){
+	int ext = samples[from].ext,last = samples[to-1].bat;
+	unsigned long long t_end = samples[to-1].t,first = 0;
+	size_t i,n = 0,with = 0,m = 0;
+	double truth,pred,err,total = 0;
+	int left,range;
+
+	// The end is when the final percentage was first reached.
+	for (i=from;i<to;i++)
+		if (samples[i].bat==last) {
+			t_end = samples[i].t;
+			break;
+		}
+	for (i=from;i<to&&samples[i].t<t_end;i++) {
+		left = ext?last-samples[i].bat:samples[i].bat-last;
+		range = ext?100-samples[i].bat:samples[i].bat;
+		if (left<=0||range<=0) continue;
+		n++;
+		if (samples[i].est<0) continue;
+		if (!with++) first = samples[i].t-samples[from].t;
+		truth = (t_end-samples[i].t)/1000.0;
+		pred = samples[i].est*(double)left/range;
+		err = truth>0?(pred>truth?pred-truth:truth-pred)/truth:0;
+		errors[m++] = err;
+		total += err;
+		if (verbose) printf("  %10.1f s  %3d%%  truth %8.0f s  estimate %8.0f s  error %5.1f%%\n",(samples[i].t-samples[from].t)/1000.0,
+			samples[i].bat,truth,pred,err*100);
+	}
+	qsort(errors,m,sizeof(*errors),cmp_double);
+	printf("%-11s %8.0f s  %3d%% -> %3d%%  %6zu samples  %5.1f%% with an estimate",ext?"charging":"discharging",
+		(t_end-samples[from].t)/1000.0,samples[from].bat,last,n,n?100.0*with/n:0);
+	if (with) printf(", first after %.1f s, error mean %.1f%% p50 %.1f%% p90 %.1f%%",first/1000.0,100*total/m,100*errors[m/2],100*errors[m*9/10]);
+	printf("\n");
+	*sum += total;
+	*covered += with;
+	return n;
+}
+
+int main(int argc,char *argv[]){
+	unsigned long long period = 1000;
+	long long seed = 0;
+	static struct ups_estimator est;
+	struct stat st;
+	const void *map;
+	double *errors,sum = 0;
+	size_t i,from,scored = 0,covered = 0;
+	int opt,fd,unit = 0,verbose = 0,etchg,etdsc;
+
+	while ((opt = getopt(argc,argv,"u:p:s:v"))!=-1) {
+		if (opt=='u') unit = atoi(optarg);
+		else if (opt=='p') period = strtoull(optarg,NULL,10);
+		else if (opt=='s') seed = atoll(optarg);
+		else if (opt=='v') verbose = 1;
+		else {
+			printf("Invalid arguments!\n");
+			return -1;
+		}
+	}
+	if (optind!=argc-1) {
+		printf("Invalid arguments!\n");
+		return -1;
+	}
+	fd = open(argv[optind],O_RDONLY);
+	if (fd<0||fstat(fd,&st)) {
+		printf("Error %d opening %s: %s\n",errno,argv[optind],strerror(errno));
+		return -1;
+	}
+	if (!st.st_size) return 0;
+	map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if (map==MAP_FAILED) {
+		printf("Error %d mapping %s: %s\n",errno,argv[optind],strerror(errno));
+		return -1;
+	}
+	close(fd);
+	if (st.st_size>=(off_t)sizeof(uint32_t)&&*(const uint32_t *)map==UPS_LOG_MAGIC) load_log(map,st.st_size,unit,period);
+	else load_text(map,st.st_size,period);
+	if (!nsamples) {
+		printf("No samples in %s.\n",argv[optind]);
+		return -1;
+	}
+
+	// Replay the trace through the estimator as UPS_comm does.
+	ups_est_init(&est);
+	ups_est_seed(&est,seed,0);
+	for (i=0;i<nsamples;i++) {
+		ups_est_update(&est,samples[i].t,samples[i].bat,samples[i].ext,&etchg,&etdsc);
+		samples[i].est = samples[i].ext?etchg:etdsc;
+	}
+
+	errors = malloc(nsamples*sizeof(*errors));
+	if (!errors) {
+		printf("Out of memory!\n");
+		return -1;
+	}
+	for (from=0,i=1;i<=nsamples;i++) {
+		if (i<nsamples&&samples[i].ext==samples[from].ext) continue;
+		scored += score_segment(from,i,verbose,errors,&sum,&covered);
+		from = i;
+	}
+	printf("total: %zu samples scored, %.1f%% with an estimate, error mean %.1f%%\n",scored,scored?100.0*covered/scored:0,covered?100*sum/covered:0);
+	return 0;
+}
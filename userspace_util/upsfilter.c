@@ -0,0 +1,102 @@
+// Checks of the UPS_filter.h noise filter, with the settings UPS_comm uses by default.
+//
+// Usage: upsfilter [-v]
+// Feeds the filter synthetic BATCAP sequences and checks that:
+// - every steady 1% step is published, from 95% up to 100% while charging,
+//   which must end in the full status, and from 5% down to 0% while
+//   discharging, each within LAG_MAX frames;
+// - a reading that flickers between two adjacent values publishes at most
+//   FLICKER_MAX changes in FLICKER_FRAMES frames.
+// -v prints every published change. Exits 1 if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../kernel_mod/UPS_schema.h"
+#include "../kernel_mod/UPS_filter.h"
+
+#define HOLD 60// Frames each percentage of a ramp is held for.
+#define LAG_MAX 30
+#define FLICKER_FRAMES 1000
+#define FLICKER_MAX 20
+
+static const struct ups_filter_conf conf = UPS_FILTER_DEFAULTS;
+static int verbose;
+
+// Feed frame i with the given readings and return the published percentage.
+static int feed(struct ups_filter *f,int i,int vin,int batcap,int *stat){
+	struct ups_frame fr = {0};
+
+	fr.vin = vin;
+	fr.batcap = batcap;
+	fr.vout = 5250;
+	*stat = ups_filter_frame(f,&conf,&fr);
+	if (verbose) printf("  %4d: %3d%% -> %3d%% %s\n",i,batcap,fr.batcap,ups_status_name(*stat));
+	return fr.batcap;
+}
+
+// Step the reading from from to to one percent every HOLD frames. Returns the number of failed checks.
+static int check_ramp(const char *name,int vin,int from,int to,int status){
+	struct ups_filter f;
+	int dir = to>from?1:-1,raw,pub,last = from,stat = -1,i = 0,j,lag,worst = 0,failed = 0;
+
+	ups_filter_reset(&f);
+	for (raw=from;raw!=to+dir;raw+=dir)
+		for (j=0;j<HOLD;j++,i++) {
+			pub = feed(&f,i,vin,raw,&stat);
+			if (pub==last) continue;
+			lag = j;
+			if (pub!=last+dir||pub!=raw) {
+				printf("%s: published %d%% after %d%% at %d%%\n",name,pub,last,raw);
+				failed++;
+			}
+			else if (lag>LAG_MAX) {
+				printf("%s: %d%% published %d frames late\n",name,pub,lag);
+				failed++;
+			}
+			if (lag>worst) worst = lag;
+			last = pub;
+		}
+	if (last!=to) {
+		printf("%s: ended at %d%% instead of %d%%\n",name,last,to);
+		failed++;
+	}
+	if (stat!=status) {
+		printf("%s: ended %s instead of %s\n",name,ups_status_name(stat),ups_status_name(status));
+		failed++;
+	}
+	printf("%-12s %d%% -> %d%%, steps published at most %d frames late, %s: %s\n",name,from,to,worst,ups_status_name(stat),failed?"FAILED":"OK");
+	return failed;
+}
+
+static int check_flicker(void){
+	struct ups_filter f;
+	int i,pub,last = 95,stat,changes = 0;
+
+	ups_filter_reset(&f);
+	srand(1);
+	for (i=0;i<FLICKER_FRAMES;i++) {
+		pub = feed(&f,i,1,95+(rand()&1),&stat);
+		if (pub!=last) changes++;
+		last = pub;
+	}
+	printf("%-12s 95%%/96%%, %d changes published in %d frames: %s\n","flicker",changes,FLICKER_FRAMES,changes>FLICKER_MAX?"FAILED":"OK");
+	return changes>FLICKER_MAX;
+}
+
+int main(int argc,char *argv[]){
+	int opt,failed = 0;
+
+	while ((opt = getopt(argc,argv,"v"))!=-1) {
+		if (opt=='v') verbose = 1;
+		else {
+			printf("Invalid arguments!\n");
+			return -1;
+		}
+	}
+	failed += check_ramp("charging",1,95,100,UPS_STATUS_FULL);
+	failed += check_ramp("discharging",0,5,0,UPS_STATUS_DISCHARGING);
+	failed += check_flicker();
+	printf(failed?"FAILED\n":"OK\n");
+	return failed?1:0;
+}
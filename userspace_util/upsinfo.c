@@ -5,6 +5,7 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include "../kernel_mod/UPS_frame.h"
 
 int set_interface_attribs(int fd,int speed,int parity){
 	struct termios tty;
@@ -70,19 +71,28 @@ int main(int argc,char *argv[]){
 	set_blocking(serial,1);                // set blocking
 
 	//usleep ((7 + 25) * 100);             // sleep enough to transmit the 7 plus receive 25: approx 100 uS per char transmit
-	char buf[100];
+	struct ups_ring ring;
+	struct ups_frame frame = {0};
+	unsigned int off,len;
+	char *ptr;
 	int n = 0;
 
-	char *bat,*vout;
-	char strout[30];
-
 	FILE *out;
+	ups_ring_init(&ring);
 	while (1) {
-		n = 0;
-		memset(buf,0,sizeof(buf));
-		memset(strout,0,sizeof(strout));
-		while (buf[0]!='$') read(serial,buf,sizeof(buf));
-		while (buf[strlen(buf)-1]!='$' && buf[strlen(buf)-1]!='\n') n += read(serial,buf+n,sizeof(buf)-n);
+		if (!ups_ring_next_frame(&ring,&off,&len)) {
+			len = ups_ring_space(&ring,&ptr);
+			n = read(serial,ptr,len);
+			if (n<0&&errno!=EINTR) {
+				printf("Error %d reading from %s: %s\n",errno,argv[1],strerror(errno));
+				close(serial);
+				return -1;
+			}
+			if (n>0) ups_ring_commit(&ring,n);
+			continue;
+		}
+		// Skip corrupted frames.
+		if (ups_ring_parse(&ring,off,len,&frame)) continue;
 		out = fopen(argv[2],"w");
 		if (!out) {
 			printf("Error %d opening %s: %s\n",errno,argv[2],strerror(errno));
@@ -90,23 +100,8 @@ int main(int argc,char *argv[]){
 			return -2;
 		}
 
-		// Printing raw input.
-//		for (int i=0;i<n;i++)
-//			printf("%c",buf[i]);
-
 		// Constructing output string.
-		if (strstr(buf,"Vin GOOD")) {
-			if (strstr(buf,"BATCAP 100")) strcpy(strout,"Charged(");
-			else strcpy(strout,"Charging(");
-		}
-		else strcpy(strout,"Discharging(");
-		bat=strstr(buf,"BATCAP")+7;
-		vout=strstr(buf,"Vout");
-		strncat(strout,bat,vout-bat-1);
-		strcat(strout,"%,");
-		strncat(strout,vout+5,strstr(buf," $")-vout-5);
-		strcat(strout,"mV)\n");
-		fprintf(out,"%s",strout);
+		fprintf(out,"%s(%d%%,%dmV)\n",frame.vin?(frame.batcap==100?"Charged":"Charging"):"Discharging",frame.batcap,frame.vout);
 		fclose(out);
 	}
 	close(serial);
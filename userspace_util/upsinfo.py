@@ -1,57 +1,73 @@
 #!/usr/bin/python3
 
+# Usage: upsinfo.py [port] [--bench frames]
+# Writes the UPS state to UPSstat.info whenever it changes. With --bench the
+# given number of frames is read and the frame rate and CPU use are reported.
+
 import re
 import serial
 import time
 import os,sys
 
+# One status frame, e.g. "$ SmartUPS V3.2P,Vin GOOD,BATCAP 87,Vout 5250 $".
+FRAME = re.compile(rb'\$ SmartUPS ([^,$]*),Vin (GOOD|NG),BATCAP (\d+),Vout (\d+) \$')
+# Bytes kept when no frame is found, enough for a partial frame.
+FRAME_MAX = 128
+
 class UPS2:
     def __init__(self,port):
-        self.ser  = serial.Serial(port,9600)        
-        
-    def get_data(self,nums):
+        # No timeout: read() sleeps in the kernel until data arrives.
+        self.ser  = serial.Serial(port,9600)
+        self.buf = bytearray()
+        self.stream = self.frames()
+
+    def frames(self):
+        # Yield (version,vin,batcap,vout) for every frame received. A frame
+        # split across reads is completed by the next read instead of dropped.
         while True:
-            self.ser.reset_input_buffer()
-            self.count = self.ser.inWaiting()
-            
-            if self.count !=0:
-                self.recv = self.ser.read(nums)
-                return self.recv
-    
+            self.buf += self.ser.read(self.ser.in_waiting or 1)
+            end = 0
+            for m in FRAME.finditer(self.buf):
+                end = m.end()
+                yield tuple(g.decode('ascii') for g in m.groups())
+            if end:
+                del self.buf[:end]
+            elif len(self.buf)>FRAME_MAX:
+                del self.buf[:-FRAME_MAX]
+
     def decode_uart(self):
-        self.uart_string = self.get_data(100)
-        self.data = self.uart_string.decode('ascii','ignore')
-        self.pattern = r'\$ (.*?) \$'
-        self.result = re.findall(self.pattern,self.data,re.S)
-    
-        self.tmp = self.result[0]
-    
-        self.pattern = r'SmartUPS (.*?),'
-        self.version = re.findall(self.pattern,self.tmp)
-    
-        self.pattern = r',Vin (.*?),'
-        self.vin = re.findall(self.pattern,self.tmp)
-        
-        self.pattern = r'BATCAP (.*?),'
-        self.batcap = re.findall(self.pattern,self.tmp)
-        
-        self.pattern = r',Vout (.*)'
-        self.vout = re.findall(self.pattern,self.tmp)
-
-        return self.version[0],self.vin[0],self.batcap[0],self.vout[0]
- 
-
-batpack = UPS2("/dev/ttyAMA2")
-
-def reflash_data():
-    version,vin,batcap,vout = batpack.decode_uart()
+        # The next frame, waiting for it if necessary.
+        return next(self.stream)
 
+
+def reflash_data(version,vin,batcap,vout):
     chg="Discharging" if vin=="NG" else "Charged" if batcap=="100" else "Charging"
 
     with open("UPSstat.info","w") as f:
         f.write(chg+"("+batcap+"%,"+vout+"mV)\n")
     print(chg+"("+batcap+"%,"+vout+"mV)\n")
+
+def bench(batpack,count):
+    batpack.decode_uart()
+    wall,cpu = time.monotonic(),time.process_time()
+    for i in range(count):
+        batpack.decode_uart()
+    wall,cpu = time.monotonic()-wall,time.process_time()-cpu
+    print("%d frames in %.2f s: %.1f frames/s, %.1f%% CPU, %.1f us CPU per frame" % (count,wall,count/wall,cpu/wall*100,cpu/count*1e6))
+
 if __name__=="__main__":
-    while (1):
-        reflash_data()
-        time.sleep(10)
+    args = sys.argv[1:]
+    count = 0
+    if "--bench" in args:
+        i = args.index("--bench")
+        count = int(args[i+1])
+        del args[i:i+2]
+    batpack = UPS2(args[0] if args else "/dev/ttyAMA2")
+    if count:
+        bench(batpack,count)
+        sys.exit(0)
+    last = None
+    for version,vin,batcap,vout in batpack.frames():
+        if (vin,batcap,vout)!=last:
+            reflash_data(version,vin,batcap,vout)
+            last = (vin,batcap,vout)
@@ -0,0 +1,104 @@
+// Print the samples of a telemetry log written by UPS_comm (UPS_LOG=path).
+//
+// Usage: upslog [-u unit] [-c] file [from [to]]
+//   from and to are Unix times in seconds; without them the whole log is printed.
+//   -u prints only the given unit.
+//   -c only counts the matching samples and reports how fast they were found.
+// The file is mapped and the blocks holding the range are found by binary
+// search, so only those are decoded.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../kernel_mod/UPS_log.h"
+#include "../kernel_mod/UPS_schema.h"
+
+// Time of the last record of block i, 0 for a block that is not valid.
+static uint64_t block_last(const uint8_t *map,size_t i){
+	const uint8_t *b = map+i*UPS_LOG_BLOCK;
+	return ups_log_block_end(b)?((const struct ups_log_header *)b)->last:0;
+}
+
+int main(int argc,char *argv[]){
+	uint64_t from = 0,to = UINT64_MAX,count = 0;
+	const uint8_t *map,*b,*p,*end;
+	struct ups_log_codec codec;
+	struct ups_log_sample s;
+	struct timespec t0,t1;
+	size_t nblocks,lo,hi,mid,i,decoded = 0;
+	struct stat st;
+	int opt,fd,unit = -1,counting = 0;
+	char when[32];
+	time_t sec;
+
+	while ((opt = getopt(argc,argv,"u:c"))!=-1) {
+		if (opt=='u') unit = atoi(optarg);
+		else if (opt=='c') counting = 1;
+		else {
+			printf("Invalid arguments!\n");
+			return -1;
+		}
+	}
+	if (optind>=argc||argc-optind>3) {
+		printf("Invalid arguments!\n");
+		return -1;
+	}
+	if (argc-optind>1) from = strtoull(argv[optind+1],NULL,10)*1000;
+	if (argc-optind>2) to = strtoull(argv[optind+2],NULL,10)*1000;
+
+	fd = open(argv[optind],O_RDONLY);
+	if (fd<0||fstat(fd,&st)) {
+		printf("Error %d opening %s: %s\n",errno,argv[optind],strerror(errno));
+		return -1;
+	}
+	nblocks = st.st_size/UPS_LOG_BLOCK;
+	if (!nblocks) return 0;
+	map = mmap(NULL,nblocks*UPS_LOG_BLOCK,PROT_READ,MAP_SHARED,fd,0);
+	if (map==MAP_FAILED) {
+		printf("Error %d mapping %s: %s\n",errno,argv[optind],strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	// First block that ends at or after from. Blocks are in time order unless the clock was set back.
+	lo = 0;
+	hi = nblocks;
+	while (lo<hi) {
+		mid = lo+(hi-lo)/2;
+		if (block_last(map,mid)<from) lo = mid+1;
+		else hi = mid;
+	}
+	if (lo<nblocks) madvise((void *)(map+lo*UPS_LOG_BLOCK),(nblocks-lo)*UPS_LOG_BLOCK,MADV_SEQUENTIAL);
+	for (i=lo;i<nblocks;i++) {
+		b = map+i*UPS_LOG_BLOCK;
+		end = ups_log_block_end(b);
+		if (!end) continue;
+		if (((const struct ups_log_header *)b)->first>to) break;
+		decoded++;
+		ups_log_codec_reset(&codec,((const struct ups_log_header *)b)->first);
+		for (p=b+sizeof(struct ups_log_header);p<end;) {
+			if (ups_log_decode(&codec,&p,end,&s)) {
+				fprintf(stderr,"Corrupted record in block %zu.\n",i);
+				break;
+			}
+			if (s.time<from||s.time>to||(unit>=0&&s.unit!=unit)) continue;
+			count++;
+			if (counting) continue;
+			sec = s.time/1000;
+			strftime(when,sizeof(when),"%Y-%m-%d %H:%M:%S",localtime(&sec));
+			printf("%s.%03d %d %s %d%% %dmV ext=%d etc=%d etd=%d\n",when,(int)(s.time%1000),s.unit,
+				ups_status_name(s.status),s.percentage,s.voltage,s.external_online,s.et_charge,s.et_discharge);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	if (counting) printf("%llu samples in %zu of %zu blocks, %.3f ms\n",(unsigned long long)count,decoded,nblocks,
+		(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6);
+	return 0;
+}
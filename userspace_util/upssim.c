@@ -0,0 +1,558 @@
+// UPSPack V3 simulator. Emits SmartUPS frames on a pseudo-terminal so that UPS_comm and upsinfo can be run without the hardware.
+//
+// Usage: upssim [options] [-- command [args]]
+//   -r rate     Frames per second (default 1).
+//   -n count    Stop after count frames (default: run forever, or 100 with a command).
+//   -s scenario steady, mainsloss, discharge, sweep or noisy (default steady).
+//               sweep changes the output voltage on every frame so that every frame is published.
+//               noisy flickers BATCAP between adjacent values and Vout just above 5200 mV with a dip below it every
+//               16 frames, with mains loss after 100 frames.
+//   -d frames   Frames per 1% of charge/discharge (default 10).
+//   -c n        Corrupt every nth frame.
+//   -p          Split every frame into several writes with short pauses.
+//   -B n        Send frames in bursts of n back-to-back frames.
+//   -m dir      Create dir with empty module parameter files and export UPS_MODPATH=dir/ to the command.
+//               The updates written to the state parameter and the status changes among them are reported on exit.
+//   -w file     Benchmark: measure latency from each frame to the next modification of file.
+//   -S path     Export UPS_SOCKET=path to the command.
+//   -C n        Load test: connect n subscribers to the -S socket and measure the time until all of them received the event.
+//   -P n        Simulate n UPSes, each on its own pty, all sending the same frames.
+//   -D sec      Stay silent for sec seconds after starting the command, like a UPS that is still booting.
+//   -U n        Unplug every UPS after every n frames and plug it back in one frame period later on a new pty.
+//               The command is given symlinks that follow the ptys, like /dev/serial/by-id links.
+//   -H n        CPU pressure: run n busy processes next to the command.
+//   -M ms       Memory pressure: page out the memory of the command every ms milliseconds, as reclaim would.
+//               With -H or -M the simulator itself runs with SCHED_FIFO so that it keeps sending on time.
+//
+// The command is started with "{}" in its arguments replaced by the pty paths, or with the paths appended when there is none.
+// On exit the frame-to-publish latency and the CPU time of the command per frame and port are reported.
+//
+// Example: upssim -s sweep -r 20 -m /tmp/ups -w /tmp/ups/state -- ../kernel_mod/UPS_comm
+//          upssim -s sweep -r 10 -n 300 -P 64 -m /tmp/ups -- ../kernel_mod/UPS_comm
+//          upssim -D 5 -n 3 -m /tmp/ups -- ../kernel_mod/UPS_comm
+//          upssim -s sweep -U 10 -n 100 -m /tmp/ups -w /tmp/ups/state -- ../kernel_mod/UPS_comm
+//          upssim -s noisy -r 50 -n 1000 -d 50 -m /tmp/ups -- ../kernel_mod/UPS_comm
+//          UPS_RT=50 upssim -s sweep -r 10 -n 300 -H 4 -M 50 -m /tmp/ups -w /tmp/ups/state -- ../kernel_mod/UPS_comm
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_SAMPLES 100000
+#define MAX_PTYS 512
+#define MAX_HOGS 64
+
+enum scenario {STEADY,MAINSLOSS,DISCHARGE,SWEEP,NOISY};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig){
+	(void)sig;
+	stop = 1;
+}
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void sleep_until(double t){
+	struct timespec ts;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t-ts.tv_sec)*1e9);
+	clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL);
+}
+
+static int cmp_double(const void *a,const void *b){
+	double x = *(const double *)a,y = *(const double *)b;
+	return x<y?-1:x>y;
+}
+
+// Build frame i of the scenario into buf.
+static int make_frame(char *buf,size_t size,enum scenario sc,long i,int per_pct,int corrupt){
+	int ext = 1,bat = 87,vout = 5250;
+
+	switch (sc) {
+		case STEADY:
+			break;
+		case MAINSLOSS:
+			if (i>=10) {
+				ext = 0;
+				bat = 87-(i-10)/per_pct;
+			}
+			break;
+		case DISCHARGE:
+			ext = 0;
+			bat = 100-i/per_pct;
+			break;
+		case SWEEP:
+			vout = 5200+i%100;
+			break;
+		case NOISY:
+			if (i>=100) {
+				ext = 0;
+				bat = 87-(i-100)/per_pct;
+			}
+			bat -= rand()&1;
+			vout = i%16!=8?5205+rand()%41:5170;
+			break;
+	}
+	if (bat<0) bat = 0;
+	if (!ext&&bat<5) vout = 5100;
+	if (corrupt) return snprintf(buf,size,"$ SmartUPS V3.2P,Vin GO#D,BATC\x01P %d,Vout %d $\r\n",bat,vout);
+	return snprintf(buf,size,"$ SmartUPS V3.2P,Vin %s,BATCAP %d,Vout %d $\r\n",ext?"GOOD":"NG",bat,vout);
+}
+
+static int make_param_dir(const char *dir){
+	const char *params[] = {"state","battery_energy","battery_present","unit_state","unit_present"};
+	char path[256];
+	int i,fd;
+
+	if (mkdir(dir,0755)&&errno!=EEXIST) return -1;
+	for (i=0;i<5;i++) {
+		snprintf(path,sizeof(path),"%s/%s",dir,params[i]);
+		fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+		if (fd<0) return -1;
+		close(fd);
+	}
+	return 0;
+}
+
+// Report the updates written to the state parameter in dir. Every one ends with the "@<ns>" sample time.
+static void report_updates(const char *dir,long frames){
+	char path[256],buf[65536],status[16],last[16] = "";
+	int fd,n,len = 0,pos = 0,pct,vlt,ext,etc,etd;
+	long updates = 0,changes = 0;
+	unsigned long long t;
+
+	snprintf(path,sizeof(path),"%s/state",dir);
+	fd = open(path,O_RDONLY);
+	if (fd<0) return;
+	while (len<(int)sizeof(buf)-1&&(n = read(fd,buf+len,sizeof(buf)-1-len))>0) len += n;
+	close(fd);
+	buf[len] = 0;
+	while (sscanf(buf+pos,"%15s %d %d %d %d %d @%llu%n",status,&pct,&vlt,&ext,&etc,&etd,&t,&n)==7) {
+		pos += n;
+		updates++;
+		if (strcmp(status,last)) changes++;
+		strcpy(last,status);
+	}
+	fprintf(stderr,"State updates: %ld (%.3f per frame), %ld status changes.\n",updates,frames?(double)updates/frames:0,changes);
+}
+
+// Connect n subscribers to the socket at path, retrying while the command starts up. Returns an epoll set with all of them.
+static int subscribe(const char *path,int n){
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	int ep,i,fd,tries;
+
+	ep = epoll_create1(0);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+	for (i=0;i<n;i++) {
+		fd = socket(AF_UNIX,SOCK_SEQPACKET|SOCK_NONBLOCK,0);
+		for (tries=0;connect(fd,(struct sockaddr *)&addr,sizeof(addr));tries++) {
+			if (tries==500) {
+				printf("Error %d connecting to %s: %s\n",errno,path,strerror(errno));
+				return -1;
+			}
+			usleep(10000);
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(ep,EPOLL_CTL_ADD,fd,&ev);
+	}
+	return ep;
+}
+
+// Read every pending message of the subscribers. Returns the number of messages.
+static int drain(int ep){
+	struct epoll_event events[64];
+	char buf[128];
+	int n,i,msgs = 0;
+
+	while ((n = epoll_wait(ep,events,64,0))>0)
+		for (i=0;i<n;i++)
+			while (recv(events[i].data.fd,buf,sizeof(buf),MSG_DONTWAIT)>0) msgs++;
+	return msgs;
+}
+
+// Open a raw pty pair. The slave is kept open so that the master never sees a hangup or echo.
+// The master is non-blocking: like a real UART, the simulator drops what a command that stopped reading cannot take.
+static int open_pty(int *master,int *slave,char **path){
+	struct termios tty;
+
+	*master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC|O_NONBLOCK);
+	if (*master<0||grantpt(*master)||unlockpt(*master)) {
+		printf("Error %d opening pty: %s\n",errno,strerror(errno));
+		return -1;
+	}
+	free(*path);
+	*path = strdup(ptsname(*master));
+	*slave = open(*path,O_RDWR|O_NOCTTY|O_CLOEXEC);
+	if (*slave<0||tcgetattr(*slave,&tty)) {
+		printf("Error %d opening %s: %s\n",errno,*path,strerror(errno));
+		return -1;
+	}
+	cfmakeraw(&tty);
+	tcsetattr(*slave,TCSANOW,&tty);
+	return 0;
+}
+
+// Point link at target, replacing it atomically.
+static int relink(const char *target,const char *link){
+	char tmp[256];
+
+	snprintf(tmp,sizeof(tmp),"%s.new",link);
+	unlink(tmp);
+	if (symlink(target,tmp)||rename(tmp,link)) {
+		printf("Error %d linking %s: %s\n",errno,link,strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Start a process that only burns CPU.
+static pid_t hog(){
+	pid_t pid = fork();
+
+	if (pid==0)
+		for (;;);
+	return pid;
+}
+
+// Start a process that pages out every mapping of target every ms milliseconds with process_madvise(MADV_PAGEOUT).
+// Locked pages are left alone, just as by reclaim. Without swap only file-backed pages can go.
+static pid_t pager(pid_t target,int ms){
+	struct iovec iov;
+	char path[64],line[512];
+	unsigned long start,end;
+	FILE *maps;
+	pid_t pid;
+	int pidfd;
+
+	pid = fork();
+	if (pid) return pid;
+	pidfd = syscall(SYS_pidfd_open,target,0);
+	if (pidfd<0) {
+		fprintf(stderr,"Error %d opening pid %d: %s\n",errno,target,strerror(errno));
+		_exit(1);
+	}
+	snprintf(path,sizeof(path),"/proc/%d/maps",target);
+	while (1) {
+		usleep(ms*1000);
+		maps = fopen(path,"r");
+		if (!maps) _exit(0);
+		// One call per mapping, as the call stops at the first one that cannot be paged out, e.g. [vvar].
+		while (fgets(line,sizeof(line),maps)) {
+			if (sscanf(line,"%lx-%lx",&start,&end)!=2) continue;
+			iov.iov_base = (void *)start;
+			iov.iov_len = end-start;
+			syscall(SYS_process_madvise,pidfd,&iov,1,MADV_PAGEOUT,0);
+		}
+		fclose(maps);
+	}
+}
+
+static pid_t spawn(char **cmd,char **ptys,int nptys){
+	char **argv;
+	int i,j,k,n,subst = 0;
+	pid_t pid;
+
+	for (n=0;cmd[n];n++);
+	argv = calloc(n+nptys+1,sizeof(char *));
+	for (i=0,k=0;i<n;i++) {
+		if (!strcmp(cmd[i],"{}")) {
+			for (j=0;j<nptys;j++) argv[k++] = ptys[j];
+			subst = 1;
+		}
+		else argv[k++] = cmd[i];
+	}
+	if (!subst)
+		for (j=0;j<nptys;j++) argv[k++] = ptys[j];
+
+	pid = fork();
+	if (pid==0) {
+		execvp(argv[0],argv);
+		fprintf(stderr,"Error %d starting %s: %s\n",errno,argv[0],strerror(errno));
+		_exit(127);
+	}
+	free(argv);
+	return pid;
+}
+
+int main(int argc,char *argv[]){
+	enum scenario sc = STEADY;
+	double rate = 1,period,next,sent_at,silent = 0,plugged = 0;
+	long count = -1,i;
+	int per_pct = 10,corrupt_every = 0,split = 0,burst = 1;
+	const char *moddir = NULL,*watch = NULL,*sock = NULL;
+	int nsubs = 0,nptys = 1,unplug = 0,nhogs = 0,pageout_ms = 0;
+	char **cmd = NULL;
+	int opt;
+
+	while ((opt = getopt(argc,argv,"r:n:s:d:c:pB:m:w:S:C:P:D:U:H:M:"))!=-1) {
+		switch (opt) {
+			case 'r': rate = atof(optarg); break;
+			case 'n': count = atol(optarg); break;
+			case 's':
+				if (!strcmp(optarg,"steady")) sc = STEADY;
+				else if (!strcmp(optarg,"mainsloss")) sc = MAINSLOSS;
+				else if (!strcmp(optarg,"discharge")) sc = DISCHARGE;
+				else if (!strcmp(optarg,"sweep")) sc = SWEEP;
+				else if (!strcmp(optarg,"noisy")) sc = NOISY;
+				else {
+					printf("Unknown scenario %s\n",optarg);
+					return -1;
+				}
+				break;
+			case 'd': per_pct = atoi(optarg); break;
+			case 'c': corrupt_every = atoi(optarg); break;
+			case 'p': split = 1; break;
+			case 'B': burst = atoi(optarg); break;
+			case 'm': moddir = optarg; break;
+			case 'w': watch = optarg; break;
+			case 'S': sock = optarg; break;
+			case 'C': nsubs = atoi(optarg); break;
+			case 'P': nptys = atoi(optarg); break;
+			case 'D': silent = atof(optarg); break;
+			case 'U': unplug = atoi(optarg); break;
+			case 'H': nhogs = atoi(optarg); break;
+			case 'M': pageout_ms = atoi(optarg); break;
+			default:
+				printf("Invalid arguments!\n");
+				return -1;
+		}
+	}
+	if (optind<argc) cmd = argv+optind;
+	if (rate<=0||silent<0||unplug<0||nhogs<0||nhogs>MAX_HOGS||pageout_ms<0||(pageout_ms&&!cmd)||per_pct<=0||burst<=0||(nsubs&&!sock)||nptys<1||nptys>MAX_PTYS) {
+		printf("Invalid arguments!\n");
+		return -1;
+	}
+	if (count<0) count = cmd?100:0;
+
+	// Open the pty pairs.
+	static int master[MAX_PTYS],slave[MAX_PTYS];
+	static char *pty[MAX_PTYS],*link[MAX_PTYS];
+	char linkdir[] = "/tmp/upssim.XXXXXX";
+	int p;
+	for (p=0;p<nptys;p++)
+		if (open_pty(&master[p],&slave[p],&pty[p])) return -1;
+	if (nptys==1) fprintf(stderr,"UPS simulator on %s\n",pty[0]);
+	else fprintf(stderr,"UPS simulator on %d ptys, %s to %s\n",nptys,pty[0],pty[nptys-1]);
+
+	// With unplugging the command is only ever given the links.
+	if (unplug) {
+		if (!mkdtemp(linkdir)) {
+			printf("Error %d creating %s: %s\n",errno,linkdir,strerror(errno));
+			return -1;
+		}
+		for (p=0;p<nptys;p++) {
+			asprintf(&link[p],"%s/ttyUPS%d",linkdir,p);
+			if (relink(pty[p],link[p])) return -1;
+		}
+		fprintf(stderr,"UPS links in %s\n",linkdir);
+	}
+
+	if (moddir) {
+		if (make_param_dir(moddir)) {
+			printf("Error %d creating %s: %s\n",errno,moddir,strerror(errno));
+			return -1;
+		}
+		char env[256];
+		snprintf(env,sizeof(env),"%s/",moddir);
+		setenv("UPS_MODPATH",env,1);
+	}
+
+	if (sock) setenv("UPS_SOCKET",sock,1);
+	// All the subscribers of the load test connect as the same user.
+	if (nsubs) {
+		char n[16];
+		snprintf(n,sizeof(n),"%d",nsubs);
+		setenv("UPS_SOCKET_PER_UID",n,0);
+	}
+
+	int ino = -1;
+	if (watch) {
+		close(open(watch,O_WRONLY|O_CREAT,0644));
+		ino = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+		if (ino<0||inotify_add_watch(ino,watch,IN_MODIFY|IN_CLOSE_WRITE)<0) {
+			printf("Error %d watching %s: %s\n",errno,watch,strerror(errno));
+			return -1;
+		}
+	}
+
+	signal(SIGINT,on_signal);
+	signal(SIGTERM,on_signal);
+	signal(SIGPIPE,SIG_IGN);
+
+	pid_t child = 0;
+	if (cmd) {
+		child = spawn(cmd,unplug?link:pty,nptys);
+		if (child<0) {
+			printf("Error %d forking: %s\n",errno,strerror(errno));
+			return -1;
+		}
+	}
+
+	// The pressure processes are started before the simulator raises its own priority, so they keep the normal class.
+	static pid_t hogs[MAX_HOGS+1];
+	int nproc = 0,h;
+	for (h=0;h<nhogs;h++) hogs[nproc++] = hog();
+	if (pageout_ms) hogs[nproc++] = pager(child,pageout_ms);
+	if (nproc) {
+		struct sched_param sp = {.sched_priority = 90};
+		if (sched_setscheduler(0,SCHED_FIFO,&sp)) fprintf(stderr,"Warning: Error %d setting SCHED_FIFO: %s\n",errno,strerror(errno));
+		fprintf(stderr,"Pressure: %d busy processes, paging out every %d ms.\n",nhogs,pageout_ms);
+	}
+
+	int subs = -1;
+	static double lat[MAX_SAMPLES],fan[MAX_SAMPLES],rec[MAX_SAMPLES];
+	long nlat = 0,missed = 0,nfan = 0,received = 0,nrec = 0;
+	char frame[128],evbuf[4096];
+	struct pollfd pfd;
+	int len,k,b;
+
+	period = burst/rate;
+	sleep_until(now()+silent);
+	next = now();
+	for (i=0;!stop&&(!count||i<count);) {
+		// Unplug, stay away for one frame period and come back on a new pty.
+		if (unplug&&i&&i%unplug==0) {
+			for (p=0;p<nptys;p++) {
+				close(slave[p]);
+				close(master[p]);
+			}
+			sleep_until(now()+period);
+			for (p=0;p<nptys;p++)
+				if (open_pty(&master[p],&slave[p],&pty[p])||relink(pty[p],link[p])) return -1;
+			plugged = now();
+			next = plugged;
+		}
+		for (b=0;b<burst&&(!count||i<count);b++,i++) {
+			len = make_frame(frame,sizeof(frame),sc,i,per_pct,corrupt_every&&(i+1)%corrupt_every==0);
+			if (split) {
+				for (k=0;k<len;k+=7) {
+					for (p=0;p<nptys;p++) write(master[p],frame+k,len-k<7?len-k:7);
+					usleep(2000);
+				}
+			}
+			else
+				for (p=0;p<nptys;p++) write(master[p],frame,len);
+		}
+		sent_at = now();
+		next += period;
+
+		// The command only serves subscribers once it has seen the UPS, so they connect after the first frame.
+		if (nsubs&&subs<0) {
+			subs = subscribe(sock,nsubs);
+			if (subs<0) break;
+			drain(subs);
+			continue;
+		}
+
+		// Wait for the watched file to change until the next frame is due.
+		if (ino>=0) {
+			int seen = 0;
+			pfd.fd = ino;
+			pfd.events = POLLIN;
+			while (!seen&&!stop) {
+				double left = next-now();
+				if (left<=0) break;
+				if (poll(&pfd,1,(int)(left*1000)+1)>0&&read(ino,evbuf,sizeof(evbuf))>0) {
+					// The first frame after plugging back in measures the recovery.
+					if (plugged) {
+						if (nrec<MAX_SAMPLES) rec[nrec++] = now()-plugged;
+					}
+					else if (nlat<MAX_SAMPLES) lat[nlat++] = now()-sent_at;
+					seen = 1;
+				}
+			}
+			if (!seen) missed++;
+		}
+		plugged = 0;
+		// Wait until every subscriber received the event, or the next frame is due.
+		if (subs>=0) {
+			int got = 0;
+			pfd.fd = subs;
+			pfd.events = POLLIN;
+			while (got<nsubs&&!stop) {
+				double left = next-now();
+				if (left<=0) break;
+				if (poll(&pfd,1,(int)(left*1000)+1)>0) got += drain(subs);
+			}
+			received += got;
+			if (got>=nsubs&&nfan<MAX_SAMPLES) fan[nfan++] = now()-sent_at;
+		}
+		sleep_until(next);
+	}
+
+	for (h=0;h<nproc;h++) {
+		kill(hogs[h],SIGKILL);
+		waitpid(hogs[h],NULL,0);
+	}
+
+	struct rusage ru;
+	memset(&ru,0,sizeof(ru));
+	if (child>0) {
+		kill(child,SIGTERM);
+		wait4(child,NULL,0,&ru);
+	}
+
+	fprintf(stderr,"Sent %ld frames.\n",i);
+	if (moddir) report_updates(moddir,i);
+	if (ino>=0) {
+		qsort(lat,nlat,sizeof(double),cmp_double);
+		double sum = 0;
+		for (k=0;k<nlat;k++) sum += lat[k];
+		fprintf(stderr,"Published %ld, missed %ld.\n",nlat,missed);
+		if (nlat) fprintf(stderr,"Frame-to-publish latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+				lat[0]*1e6,sum/nlat*1e6,lat[nlat/2]*1e6,lat[nlat*99/100]*1e6,lat[nlat-1]*1e6);
+	}
+	if (nrec) {
+		qsort(rec,nrec,sizeof(double),cmp_double);
+		fprintf(stderr,"Plug-to-publish recovery (ms) over %ld replugs: min %.2f p50 %.2f max %.2f\n",
+				nrec,rec[0]*1e3,rec[nrec/2]*1e3,rec[nrec-1]*1e3);
+	}
+	if (subs>=0) {
+		qsort(fan,nfan,sizeof(double),cmp_double);
+		fprintf(stderr,"%d subscribers received %ld events, %ld frames reached all of them.\n",nsubs,received,nfan);
+		if (nfan) fprintf(stderr,"Fan-out latency (us): min %.1f p50 %.1f p99 %.1f max %.1f\n",
+				fan[0]*1e6,fan[nfan/2]*1e6,fan[nfan*99/100]*1e6,fan[nfan-1]*1e6);
+	}
+	if (child>0&&i) {
+		double cpu = ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+		fprintf(stderr,"Command CPU time: %.3f s total, %.1f us per frame.\n",cpu,cpu/i*1e6);
+		fprintf(stderr,"Command page faults: %ld major, %ld minor.\n",ru.ru_majflt,ru.ru_minflt);
+		if (nptys>1) fprintf(stderr,"Command CPU time per port: %.1f us per frame, %.3f%% of a CPU at %g frames/s.\n",
+				cpu/i/nptys*1e6,cpu/i/nptys*rate*100,rate);
+	}
+	for (p=0;p<nptys;p++) {
+		close(slave[p]);
+		close(master[p]);
+		if (unplug) unlink(link[p]);
+	}
+	if (unplug) rmdir(linkdir);
+	return 0;
+}
@@ -0,0 +1,51 @@
+// Print the UPS state from the shared-memory status board published by UPS_comm.
+//
+// Usage: upsstat [-a]
+//   Without options prints one line in the UPSstat.info format, e.g. "Charging(87%,5250mV)".
+//   -a prints every field as key=value.
+// The board name can be overridden with the UPS_BOARD environment variable.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "../kernel_mod/UPS_board.h"
+#include "../kernel_mod/UPS_schema.h"
+
+int main(int argc,char *argv[]){
+	const struct ups_board *board;
+	struct ups_board_data d;
+	struct timespec ts;
+	int all = argc==2&&!strcmp(argv[1],"-a");
+
+	if (argc>2||(argc==2&&!all)) {
+		printf("Invalid arguments!\n");
+		return -1;
+	}
+
+	board = ups_board_open(ups_board_name());
+	if (!board) {
+		printf("Error %d opening status board %s: %s\n",errno,ups_board_name(),strerror(errno));
+		return -1;
+	}
+	if (ups_board_read(board,&d)) {
+		printf("No data published yet.\n");
+		return -2;
+	}
+
+	if (!all) {
+		printf("%s(%d%%,%dmV)\n",d.external_online?(d.percentage==100?"Charged":"Charging"):"Discharging",d.percentage,d.voltage);
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	printf("version=%.*s\n",(int)sizeof(d.version),d.version);
+	printf("status=%s\n",ups_status_name(d.status));
+	printf("percentage=%d\n",d.percentage);
+	printf("voltage=%d\n",d.voltage);
+	printf("external_online=%d\n",d.external_online);
+	printf("et_charge=%d\n",d.et_charge);
+	printf("et_discharge=%d\n",d.et_discharge);
+	printf("updates=%llu\n",(unsigned long long)d.updates);
+	printf("age=%.3f\n",((unsigned long long)ts.tv_sec*1000000000+ts.tv_nsec-d.timestamp)/1e9);
+	return 0;
+}
@@ -0,0 +1,279 @@
+// Stress test of the UPS_powermod state locking. Needs the module loaded and root.
+//
+// Usage: upsstress [-t seconds]
+// One thread writes two alternating states A and B to the "state" parameter
+// as fast as it can, in which every field differs. Meanwhile other threads
+// read the state back through the "state" parameter, /dev/ups, the battery
+// uevent file in sysfs and the uevents broadcast on every change. A read
+// that is neither A nor B is a torn state and fails the test.
+//
+// The power_supply core reads every property with a separate call, so a
+// uevent may mix properties of A and B; these are counted but are not torn.
+// Each property on its own must still be one of A or B.
+// The state found at startup is written back on exit. Do not run UPS_comm
+// at the same time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "../kernel_mod/UPS_schema.h"
+#include "../kernel_mod/UPS_record.h"
+
+#define MODPATH "/sys/module/UPS_powermod/parameters/"
+#define PSPATH "/sys/class/power_supply/battery/uevent"
+#define DEVPATH "/dev/ups"
+
+static const struct ups_fields states[2] = {
+	{UPS_STATUS_CHARGING,20,5220,1,600,-1,0,0},
+	{UPS_STATUS_DISCHARGING,80,5180,0,-1,3000,0,0},
+};
+
+struct reader {
+	const char *name;
+	void *(*run)(void *);
+	pthread_t thread;
+	unsigned long reads,torn,mixed;
+};
+
+static volatile int stop;
+static unsigned long writes;
+static int energy;// battery_energy, for CHARGE_NOW.
+
+// Index of the state matching the batched fields of f, or -1 if it is torn.
+static int match_state(const struct ups_fields *f){
+	int i;
+
+	for (i=0;i<2;i++) {
+#define UPS_STATE_CMP(c,name,kind,min,max,batched,desc) UPS_IF_##batched(if (f->name!=states[i].name) continue;)
+		UPS_FIELDS(UPS_STATE_CMP,)
+#undef UPS_STATE_CMP
+		return i;
+	}
+	return -1;
+}
+
+static void *run_writer(void *arg){
+	char buf[2][96];
+	int fd,i,len[2];
+
+	(void)arg;
+	fd = open(MODPATH "state",O_WRONLY);
+	if (fd<0) {
+		printf("Error %d opening %s: %s\n",errno,MODPATH "state",strerror(errno));
+		stop = 1;
+		return NULL;
+	}
+	for (i=0;i<2;i++) len[i] = sprintf(buf[i],UPS_STATE_FMT UPS_STATE_ARGS(states[i]));
+	for (i=0;!stop;i^=1) {
+		if (pwrite(fd,buf[i],len[i],0)!=len[i]) {
+			printf("Error %d writing the state: %s\n",errno,strerror(errno));
+			stop = 1;
+			break;
+		}
+		writes++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *run_param(void *arg){
+	struct reader *r = arg;
+	struct ups_fields f;
+	unsigned long long sampled;
+	const char *p;
+	char buf[128];
+	int fd,n,stale;
+
+	fd = open(MODPATH "state",O_RDONLY);
+	if (fd<0) return NULL;
+	while (!stop) {
+		n = pread(fd,buf,sizeof(buf)-1,0);
+		if (n<=0) break;
+		buf[n] = '\0';
+		p = buf;
+		r->reads++;
+		if (ups_parse_state(&p,&f)||ups_parse_state_flags(p,&stale,&sampled)||match_state(&f)<0) r->torn++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *run_dev(void *arg){
+	struct reader *r = arg;
+	struct pollfd pfd;
+	struct ups_record rec;
+	struct ups_fields f;
+
+	pfd.fd = open(DEVPATH,O_RDONLY|O_NONBLOCK);
+	if (pfd.fd<0) return NULL;
+	pfd.events = POLLIN;
+	while (!stop) {
+		if (poll(&pfd,1,100)<=0) continue;
+		if (read(pfd.fd,&rec,sizeof(rec))!=sizeof(rec)) continue;
+#define UPS_RECORD_FIELD(c,name,kind,min,max,batched,desc) f.name = rec.name;
+		UPS_FIELDS(UPS_RECORD_FIELD,)
+#undef UPS_RECORD_FIELD
+		r->reads++;
+		if (match_state(&f)<0) r->torn++;
+	}
+	close(pfd.fd);
+	return NULL;
+}
+
+// Properties of the battery that follow the state, as named in uevents.
+enum {PROP_STATUS,PROP_CAPACITY,PROP_VOLTAGE,PROP_CHARGE,PROP_ETC,PROP_ETD,PROPS};
+static const char *const props[PROPS] = {"STATUS","CAPACITY","VOLTAGE_NOW","CHARGE_NOW","TIME_TO_FULL_NOW","TIME_TO_EMPTY_AVG"};
+
+// Whether value v of property prop belongs to state s.
+static int prop_matches(int prop,const char *v,const struct ups_fields *s){
+	switch (prop) {
+		case PROP_STATUS: return !strcasecmp(v,ups_status_name(s->battery_status));
+		case PROP_CAPACITY: return atoi(v)==s->battery_percentage;
+		case PROP_VOLTAGE: return atoi(v)==s->output_voltage;
+		case PROP_CHARGE: return atoi(v)==s->battery_percentage*energy/100;
+		case PROP_ETC: return atoi(v)==s->et_charge;
+		case PROP_ETD: return atoi(v)==s->et_discharge;
+	}
+	return 0;
+}
+
+// Check the POWER_SUPPLY_* variables of a battery uevent, separated by sep. Each property must come from A or B.
+static void check_props(struct reader *r,const char *env,const char *end,char sep){
+	int i,prop,found = 0,torn = 0,seen[2] = {0,0};
+	const char *line,*next,*eq;
+	char v[32];
+
+	for (line=env;line<end;line=next) {
+		next = memchr(line,sep,end-line);
+		if (!next) next = end;
+		eq = memchr(line,'=',next-line);
+		if (!eq||strncmp(line,"POWER_SUPPLY_",13)||next-eq-1>=(int)sizeof(v)) goto skip;
+		for (prop=0;prop<PROPS;prop++)
+			if ((size_t)(eq-line-13)==strlen(props[prop])&&!strncmp(line+13,props[prop],eq-line-13)) break;
+		if (prop==PROPS) goto skip;
+		memcpy(v,eq+1,next-eq-1);
+		v[next-eq-1] = '\0';
+		found++;
+		for (i=0;i<2;i++) seen[i] += prop_matches(prop,v,&states[i]);
+		if (!prop_matches(prop,v,&states[0])&&!prop_matches(prop,v,&states[1])) torn++;
+skip:
+		if (next<end) next++;
+	}
+	if (!found) return;
+	r->reads++;
+	if (torn) r->torn++;
+	else if (seen[0]<found&&seen[1]<found) r->mixed++;
+}
+
+static void *run_sysfs(void *arg){
+	struct reader *r = arg;
+	char buf[4096];
+	int fd,n;
+
+	fd = open(PSPATH,O_RDONLY);
+	if (fd<0) return NULL;
+	while (!stop) {
+		n = pread(fd,buf,sizeof(buf),0);
+		if (n<=0) break;
+		check_props(r,buf,buf+n,'\n');
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *run_uevent(void *arg){
+	struct reader *r = arg;
+	struct sockaddr_nl addr;
+	struct timeval tv = {0,100000};
+	char buf[8192];
+	int fd,n;
+
+	fd = socket(AF_NETLINK,SOCK_DGRAM|SOCK_CLOEXEC,NETLINK_KOBJECT_UEVENT);
+	if (fd<0) return NULL;
+	memset(&addr,0,sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(fd,(struct sockaddr *)&addr,sizeof(addr))) {
+		close(fd);
+		return NULL;
+	}
+	setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+	while (!stop) {
+		n = recv(fd,buf,sizeof(buf),0);
+		if (n<=0) continue;
+		// "change@/devices/.../power_supply/battery" followed by NUL separated variables.
+		if (n>=(int)sizeof(buf)||!strstr(buf,"/power_supply/battery")) continue;
+		check_props(r,buf,buf+n,'\0');
+	}
+	close(fd);
+	return NULL;
+}
+
+static int read_param(const char *name,char *buf,size_t size){
+	char path[128];
+	int fd,n;
+
+	snprintf(path,sizeof(path),MODPATH "%s",name);
+	fd = open(path,O_RDONLY);
+	if (fd<0) return -1;
+	n = read(fd,buf,size-1);
+	close(fd);
+	if (n<0) return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+int main(int argc,char *argv[]){
+	struct reader readers[] = {
+		{.name = "state parameter",.run = run_param},
+		{.name = DEVPATH,.run = run_dev},
+		{.name = PSPATH,.run = run_sysfs},
+		{.name = "uevents",.run = run_uevent},
+	};
+	pthread_t writer;
+	char saved[128],buf[32];
+	unsigned long torn = 0;
+	int opt,fd,i,seconds = 10;
+
+	while ((opt = getopt(argc,argv,"t:"))!=-1) {
+		if (opt=='t') seconds = atoi(optarg);
+		else {
+			printf("Invalid arguments!\n");
+			return -1;
+		}
+	}
+	if (read_param("state",saved,sizeof(saved))<0||read_param("battery_energy",buf,sizeof(buf))<0) {
+		printf("Error %d reading %s: %s. Is the module loaded?\n",errno,MODPATH,strerror(errno));
+		return -1;
+	}
+	energy = atoi(buf);
+
+	for (i=0;i<(int)(sizeof(readers)/sizeof(*readers));i++) pthread_create(&readers[i].thread,NULL,readers[i].run,&readers[i]);
+	pthread_create(&writer,NULL,run_writer,NULL);
+	for (i=0;i<seconds*10&&!stop;i++) usleep(100000);
+	stop = 1;
+	pthread_join(writer,NULL);
+	for (i=0;i<(int)(sizeof(readers)/sizeof(*readers));i++) pthread_join(readers[i].thread,NULL);
+
+	fd = open(MODPATH "state",O_WRONLY);
+	if (fd<0||write(fd,saved,strlen(saved))<0) printf("Error %d restoring the state: %s\n",errno,strerror(errno));
+	if (fd>=0) close(fd);
+
+	printf("%lu writes\n",writes);
+	for (i=0;i<(int)(sizeof(readers)/sizeof(*readers));i++) {
+		printf("%-40s %10lu reads, %lu torn",readers[i].name,readers[i].reads,readers[i].torn);
+		if (readers[i].mixed) printf(", %lu mixing A and B",readers[i].mixed);
+		printf("\n");
+		torn += readers[i].torn;
+	}
+	printf(torn?"FAILED\n":"OK\n");
+	return torn?1:0;
+}